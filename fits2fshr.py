@@ -1,61 +1,388 @@
 import fitsio
 import fsfits
+from fsfits import gzfits
+from fsfits import bitshuffle
 from argparse import ArgumentParser
+from multiprocessing.pool import ThreadPool
+import multiprocessing
+import threading
+import collections
+import itertools
+import shutil
+import os.path
 import json
 import numpy
 ap = ArgumentParser()
 
-ap.add_argument('--check', action='store_true', default=False, 
+ap.add_argument('--check', action='store_true', default=False,
         help="Test if output contains identical information to input")
 
+ap.add_argument('-j', '--jobs', type=int, default=multiprocessing.cpu_count(),
+        help="Number of HDUs compressed and written concurrently; the"
+             " cores are divided between them")
 
-ap.add_argument('input')
+ap.add_argument('--max-memory', type=float, default=1024,
+        help="Bound in MB on the HDU data held in memory while converting")
+
+ap.add_argument('--tiles', default=None,
+        help="Store images in tiles of this shape, e.g. 64,64, so cutouts"
+             " only decompress the tiles they overlap")
+
+ap.add_argument('--codec', default='bslz4', choices=fsfits.CODECS,
+        help="Compression of the blocks: bslz4 (default), bszlib for a"
+             " better ratio, bitshuffle or raw for the fastest reads")
+
+ap.add_argument('--block-size', default=None,
+        help="Elements compressed as a unit, a multiple of 8, or auto to"
+             " benchmark a few sizes on the data of each HDU")
+
+ap.add_argument('--native', action='store_true', default=False,
+        help="Store the big endian FITS data in the byte order of this"
+             " machine; the swap is fused into the compression")
+
+ap.add_argument('--band', type=float, default=16,
+        help="MB of rows decoded at a time from compressed (.fz, .gz) or"
+             " large HDUs, decoding the next while the last is written")
+
+ap.add_argument('--checksums', action='store_true', default=False,
+        help="Store a CRC32C of every compressed chunk; reads verify them"
+             " and fail on corrupt data")
+
+ap.add_argument('--filter', default=None, choices=fsfits.FILTERS[1:],
+        help="Store numbers as the difference to the one before them, for"
+             " sorted columns (delta, xor for all bits) or to the row above,"
+             " for smooth images (rows); bslz4 and bszlib only")
+
+ap.add_argument('--mpi', action='store_true', default=False,
+        help="Run as an MPI job (mpi4py): the HDUs are shared out between"
+             " the ranks, those larger than --max-memory are compressed"
+             " by all ranks together, a band of rows each, unless they"
+             " are tiled by --tiles")
+
+ap.add_argument('input', nargs='+',
+        help="FITS files; with more than one, output is a directory")
 ap.add_argument('output')
 
 ns = ap.parse_args()
 
+class Budget(object):
+    """ Bytes of HDU data in flight. acquire blocks the reader until the
+        writers have released enough; a single HDU larger than the
+        budget is still let through, alone. """
+    def __init__(self, limit):
+        self.limit = limit
+        self.used = 0
+        self.cond = threading.Condition()
+
+    def acquire(self, nbytes):
+        with self.cond:
+            while self.used > 0 and self.used + nbytes > self.limit:
+                self.cond.wait()
+            self.used += nbytes
+
+    def release(self, nbytes):
+        with self.cond:
+            self.used -= nbytes
+            self.cond.notify_all()
+
+def limit_threads():
+    """ Initializer of the writer threads: each compresses its HDU
+        with its own OpenMP threads, so -j writers share out the cores
+        instead of each starting one thread per core. """
+    bitshuffle.set_num_threads(max(1,
+        multiprocessing.cpu_count() // max(ns.jobs, 1)))
+
+def block_tiles(shape, dtype):
+    """ The tiles of the block of an HDU of shape and dtype, by
+        --tiles, or None if it is not tiled. """
+    if ns.tiles is None or dtype.names is not None:
+        return None
+    tiles = [int(t) for t in ns.tiles.split(',')]
+    if len(tiles) != len(shape):
+        return None
+    return [min(t, max(n, 1)) for t, n in zip(tiles, shape)]
+
+def create_block(fout, name, shape, dtype):
+    tiles = block_tiles(shape, dtype)
+    block_size = ns.block_size
+    if block_size is not None and block_size != 'auto':
+        block_size = int(block_size)
+    return fout.create_block(name, shape, dtype, tiles=tiles,
+            codec=ns.codec, block_size=block_size, native=ns.native,
+            checksums=ns.checksums, filter=ns.filter)
+
+def tile_rows(hdu):
+    """ Rows in a tile of a tile compressed (fpack) image, 0 if the
+        HDU is not one. """
+    if not hdu.has_data() or not getattr(hdu, 'is_compressed', bool)():
+        return 0
+    # row tiles, the fpack default, without a ZTILE2
+    return max(int(hdu.read_header().get('ZTILE2', 1)), 1)
+
+def hdu_rows(hdu):
+    """ Number of rows of the HDU data and a function reading rows lo
+        to hi, or None if the HDU has no data. """
+    type = hdu.get_exttype()
+    if hdu.has_data():
+        if type in (
+                'BINARY_TBL',
+                'ASCII_TBL'):
+            return hdu.get_nrows(), lambda lo, hi: hdu[lo:hi]
+        elif type in ('IMAGE_HDU'):
+            return hdu.get_dims()[0], lambda lo, hi: hdu[lo:hi, :]
+    return None
+
+def read_hdu(hdu):
+    header = hdu.read_header()
+    header = dict(header)
+    rows = hdu_rows(hdu)
+    data = None
+    if rows is not None:
+        nrows, read = rows
+        data = read(0, nrows)
+    return header, data
+
+def stream_hdu(block, nrows, read, rowbytes, budget, tile=1):
+    """ Convert an HDU a band of rows at a time: the next band is read,
+        and decoded for compressed input, on this thread while the
+        writer thread compresses the previous one. Bands are whole
+        tiles of tile rows, so no input tile is decoded twice. At most
+        three bands are in memory. """
+    band = min(budget.limit // 8, ns.band * 1024 * 1024)
+    step = max(1, int(band // max(rowbytes, 1)))
+    step = max(step // tile, 1) * tile
+    nbytes = 3 * step * rowbytes
+    budget.acquire(nbytes)
+    writer = ThreadPool(1, initializer=limit_threads)
+    try:
+        pending = collections.deque()
+        for lo in range(0, nrows, step):
+            rows = read(lo, min(lo + step, nrows))
+            if len(pending) == 2:
+                pending.popleft().get()
+            pending.append(writer.apply_async(block.write_chunk, (rows,)))
+            del rows
+        while pending:
+            pending.popleft().get()
+        block.flush()
+    finally:
+        writer.terminate()
+        budget.release(nbytes)
+
+def convert_gz(input, output, budget):
+    """ Convert a gzipped FITS file as it is decompressed, the images
+        streamed a band at a time. False if an HDU can not be
+        streamed; the output is removed, for fitsio to convert. It is
+        removed on any other error too, which is raised. """
+    fout = fsfits.FSHR.create(output)
+    try:
+        for hdui, hdu in enumerate(gzfits.open(input)):
+            name = "HDU-%04d" % hdui
+            if not hdu.has_data():
+                block = fout.create_block(name, (0,), None)
+                block.metadata.update(hdu.header)
+                block.flush()
+                continue
+            if hdu.dtype is None:
+                raise gzfits.Unsupported(name)
+            block = create_block(fout, name, hdu.shape, hdu.dtype)
+            block.metadata.update(hdu.header)
+            rowbytes = hdu.dtype.itemsize * int(numpy.prod(hdu.shape[1:]))
+            stream_hdu(block, hdu.shape[0], hdu.read, rowbytes, budget)
+        fout.flush()
+    except gzfits.Unsupported:
+        shutil.rmtree(output)
+        return False
+    except Exception:
+        # no half written tree without a manifest
+        shutil.rmtree(output)
+        raise
+    return True
+
+def check_hdu(fout, hdui, header, data):
+    block = fout["HDU-%04d" % hdui]
+    with block:
+        for key in header:
+            assert header[key] == block.metadata[key]
+
+        if data is not None:
+            assert (block[...] == data).all()
+        else:
+            assert block[...] is None
+
+def write_hdu(block, data, budget, nbytes):
+    """ Runs on the pool: compress and write one HDU. The compressor
+        releases the GIL, so several of these run at once. """
+    try:
+        with block:
+            if data is not None:
+                block[...] = data
+    finally:
+        budget.release(nbytes)
+
+def outputname(input):
+    if len(ns.input) == 1:
+        return ns.output
+    name = os.path.basename(input)
+    for ext in ('.gz', '.fz', '.fits', '.fit'):
+        if name.endswith(ext):
+            name = name[:-len(ext)]
+    return os.path.join(ns.output, name)
+
+class Share(object):
+    """ Which HDUs this rank converts under --mpi: HDUs larger than the
+        memory budget by all ranks together, see convert_collective,
+        the others, and whole .gz files, by each rank in turn. Without
+        a communicator all are converted here. """
+    def __init__(self, comm=None):
+        self.comm = comm
+        self.turn = 0
+
+    def mine(self):
+        turn, self.turn = self.turn, self.turn + 1
+        return self.comm is None or turn % self.comm.size == self.comm.rank
+
+def convert_collective(comm, fout, name, hdu, nrows, read, first):
+    """ Convert an HDU with all ranks: rank 0 creates the block, each
+        rank reads and compresses its band of rows, and the chunks are
+        written in place, see fsfits.mpi.write. """
+    from fsfits import mpi
+    if comm.rank == 0:
+        block = create_block(fout, name, (nrows,) + first.shape[1:],
+                first.dtype)
+        block.metadata.update(dict(hdu.read_header()))
+        block.flush()
+    comm.barrier()
+    if comm.rank != 0:
+        block = fsfits.Block.open(os.path.join(fout.path, name))
+    if block.block_size == 'auto':
+        sample = None
+        if comm.rank == 0:
+            sample = read(0, min(nrows, max(1024 * 1024 // first.nbytes, 1)))
+        mpi.tune(comm, block, sample)
+    lo, hi = mpi.partition(comm, block)
+    mpi.write(comm, block, read(lo, hi), lo)
+
+def convert_hdus(fin, fout, budget, pool, pending, share):
+    """ Convert or check the HDUs of fin that are this rank's share """
+    for hdui, hdu in enumerate(fin):
+        name = "HDU-%04d" % hdui
+        if ns.check:
+            if share.mine():
+                header, data = read_hdu(hdu)
+                check_hdu(fout, hdui, header, data)
+            continue
+
+        rows = hdu_rows(hdu)
+        large = False
+        if rows is not None:
+            nrows, read = rows
+            first = read(0, min(nrows, 1))
+            large = first.nbytes * nrows > budget.limit
+            # tiled blocks are not written collectively; a large
+            # tiled image is streamed by one rank below
+            if large and share.comm is not None and block_tiles(
+                    (nrows,) + first.shape[1:], first.dtype) is None:
+                convert_collective(share.comm, fout, name, hdu, nrows,
+                        read, first)
+                continue
+        if not share.mine():
+            continue
+        if rows is not None:
+            # tiles are decoded a band at a time instead of the
+            # whole image at once
+            tile = tile_rows(hdu)
+            if tile or large:
+                block = create_block(fout, name,
+                    (nrows,) + first.shape[1:], first.dtype)
+                block.metadata.update(dict(hdu.read_header()))
+                stream_hdu(block, nrows, read, first.nbytes, budget,
+                        max(tile, 1))
+                continue
+
+        # the budget is taken before the HDU is read, so the reader
+        # waits for the writers with no HDU in hand
+        nbytes = 0
+        if rows is not None:
+            nbytes = first.nbytes * nrows
+        budget.acquire(nbytes)
+        header, data = read_hdu(hdu)
+
+        if data is not None:
+            block = create_block(fout, name, data.shape, data.dtype)
+        else:
+            block = fout.create_block(name, (0,), None)
+        block.metadata.update(header)
+        pending.append(pool.apply_async(write_hdu,
+            (block, data, budget, nbytes)))
+        del data
+
 def main():
-    fin = fitsio.FITS(ns.input)
-    if ns.check:
-        fout = fsfits.FSHR.open(ns.output)
-    else:
-        fout = fsfits.FSHR.create(ns.output)
-
-    with fout:
-        for hdui, hdu in enumerate(fin):
-            header = hdu.read_header()
-            header = dict(header)
-            type = hdu.get_exttype()
-            if hdu.has_data():
-                if type in (
-                        'BINARY_TBL',
-                        'ASCII_TBL'):
-                    data = hdu[:]
-                elif type in ('IMAGE_HDU'):
-                    data = hdu[:, :]
-            else:
-                data = None
-
-            if ns.check:
-                block = fout["HDU-%04d" % hdui]
-                with block:
-                    for key in header:
-                        assert header[key] == block.metadata[key]
-
-                    if data is not None:
-                        assert (block[...] == data).all()
-                    else:
-                        assert block[...] is None
-            else:
-                if data is not None:
-                    block = fout.create_block("HDU-%04d" % hdui,
-                        data.shape, data.dtype)
-                else:
-                    block = fout.create_block("HDU-%04d" % hdui,
-                        (0,), None)
-                with block:
-                    block.metadata.update(header)
-                    if data is not None:
-                        block[...] = data
+    comm = None
+    if ns.mpi:
+        from mpi4py import MPI
+        comm = MPI.COMM_WORLD
+    share = Share(comm)
+    budget = Budget(ns.max_memory * 1024 * 1024)
+    pool = ThreadPool(max(ns.jobs, 1), initializer=limit_threads)
+    pending = []
+    outputs = []
+    # trees written by all ranks; rank 0 writes their list of blocks
+    shared = []
+
+    # HDUs are read in order on this thread, fitsio objects are not
+    # thread safe; while the next one is read the pool compresses and
+    # writes the previous ones, across files.
+    for input in ns.input:
+        output = outputname(input)
+        if not ns.check and input.endswith('.gz'):
+            # decompressed as a whole by cfitsio, one rank converts it
+            if not share.mine():
+                continue
+            # cfitsio would decompress all of a .gz before the first HDU
+            if convert_gz(input, output, budget):
+                continue
+            fout = fsfits.FSHR.create(output)
+            outputs.append(fout)
+            fin = fitsio.FITS(input)
+            convert_hdus(fin, fout, budget, pool, pending, Share())
+            fin.close()
+            continue
+
+        if ns.check:
+            fout = fsfits.FSHR.open(output)
+            outputs.append(fout)
+        elif comm is None:
+            fout = fsfits.FSHR.create(output)
+            outputs.append(fout)
+        else:
+            if comm.rank == 0:
+                fout = fsfits.FSHR.create(output)
+            comm.barrier()
+            if comm.rank != 0:
+                fout = fsfits.FSHR.open(output, preload=False)
+            shared.append(fout)
+        fin = fitsio.FITS(input)
+        convert_hdus(fin, fout, budget, pool, pending, share)
+        fin.close()
+
+    pool.close()
+    for result in pending:
+        # re-raises any error of the writer
+        result.get()
+    pool.join()
+    for fout in outputs:
+        fout.flush()
+    if shared:
+        # each rank knows the blocks it created
+        blocks = comm.gather([fout.blocks for fout in shared], root=0)
+        if comm.rank == 0:
+            for i, fout in enumerate(shared):
+                fout.blocks = sorted(set(
+                    itertools.chain(*[b[i] for b in blocks])))
+                fout._dirty = True
+                fout.flush()
+    if comm is not None:
+        comm.barrier()
 
 main()
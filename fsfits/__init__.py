@@ -1,38 +1,226 @@
 import os.path
+import itertools
+import collections
 import json
 import numpy
 import pickle
+import time
 import bitshuffle
+import cache
+from multiprocessing.pool import ThreadPool
+
+# How the streams of a block are compressed, also the extension of
+# their files: bitshuffle and LZ4, bitshuffle and zlib, for a better
+# ratio at a higher cost, bitshuffle only, or not at all.
+CODECS = ('bslz4', 'bszlib', 'bitshuffle', 'raw')
+# filters of the numbers of each chunk before it is bitshuffled, see
+# Block.create
+FILTERS = (None, 'delta', 'xor', 'rows')
 
 class Block(object):
-    def __init__(self, path):
+    def __init__(self, path, mmap=True):
         self.path = path
-        try:
-            os.makedirs(self.path)
-        except OSError:
-            pass
-        if not os.path.exists(self.path):
-            raise IOError("path %s not avalable" % self.path)
-
-        self.datafilename = os.path.join(
-                path, 'data.bin.bslz4')
+        self.mmap = mmap
         self.dtypefilename = os.path.join(
                 path, 'dtype.pickle')
         self.metadatafilename = os.path.join(
                 path, 'meta.json')
-        self.metadata = {}
+        self._metadata = None
+        self._metadatajson = None
+        self._writing = False
+        # what dtype.pickle and meta.json hold, to skip rewriting them.
+        self._flushed_dtype = None
+        self._flushed_metadata = None
+
+    # read from dtype.pickle when first used, see __getattr__.
+    _LAZY = ('dtype', 'shape', 'unwritten', 'layout', 'tiles', 'codec',
+            'block_size', 'checksums', 'filter', 'streams')
 
     @classmethod
-    def open(kls, path):
-        self = kls(path)
-        with file(self.dtypefilename, 'r') as ff:
-            d = pickle.load(ff)
-            self.dtype = d['dtype']
-            self.shape = d['shape']
-        with file(self.metadatafilename, 'r') as ff:
-            self.metadata.update(json.load(ff)) 
+    def open(kls, path, mmap=True, entry=None, preload=True):
+        """ Open the block at path; entry is its entry in the manifest
+            of the tree, to open it without reading any file. With
+            preload False even dtype.pickle is only read when the
+            dtype, shape or data is first asked for. The header in
+            meta.json is always parsed on first use. """
+        self = kls(path, mmap)
+        if entry is not None:
+            self._metadatajson = entry['metadata']
+            self._load(entry['dtype'], entry['streams'])
+        elif preload:
+            self._load_dtype()
         return self
 
+    def __getattr__(self, name):
+        if name not in Block._LAZY:
+            raise AttributeError(name)
+        self._load_dtype()
+        return self.__dict__[name]
+
+    def _load_dtype(self):
+        d = _load_cached(self.dtypefilename, pickle.load)
+        if d is None:
+            raise IOError("no block at %s" % self.path)
+        self._load(d)
+
+    def _load(self, d, streams={}):
+        self.dtype = d['dtype']
+        self.shape = d['shape']
+        # no data file yet, all elements read as zeros.
+        self.unwritten = d.get('unwritten', False)
+        self.layout = d.get('layout', 'flat')
+        self.tiles = d.get('tiles', None)
+        self.codec = d.get('codec', 'bslz4')
+        self.block_size = d.get('block_size', None)
+        self.checksums = d.get('checksums', False)
+        self.filter = d.get('filter', None)
+        self._setup_streams()
+        for stream, subshape in self.streams.values():
+            name = os.path.basename(stream.datafilename)
+            if name in streams:
+                stream.preload(*streams[name])
+        self._flushed_dtype = self._dumps()
+
+    @property
+    def metadata(self):
+        """ The header of the block, parsed when first used. """
+        if self._metadata is None:
+            if self._metadatajson is None:
+                self._metadatajson = _load_cached(self.metadatafilename,
+                        lambda ff: ff.read())
+            if self._metadatajson is None:
+                self._metadata = {}
+            else:
+                self._metadata = json.loads(self._metadatajson)
+                self._flushed_metadata = json.dumps(self._metadata,
+                        sort_keys=True)
+        return self._metadata
+
+    def stats(self):
+        """ Time spent and bytes moved by the reads and writes of the
+            streams of the block: read_time and read_bytes of the
+            compressed data, decode_time and decoded_bytes of
+            decompressing it, encode_time and encoded_bytes of
+            compressing, write_time and written_bytes of writing.
+            With mmap the data is only read from disk as it is
+            decompressed, its time is part of decode_time. The counts
+            are of this Block object; FSHR opens a new one on every
+            ff[name]. """
+        total = collections.Counter()
+        for stream, subshape in self.streams.values():
+            total.update(stream.stats)
+        return dict(total)
+
+    def _dumps(self):
+        """ The contents of dtype.pickle """
+        d = {}
+        d['dtype'] = self.dtype
+        d['shape'] = self.shape
+        d['unwritten'] = self.unwritten
+        d['layout'] = self.layout
+        d['tiles'] = self.tiles
+        d['codec'] = self.codec
+        d['block_size'] = self.block_size
+        d['checksums'] = self.checksums
+        d['filter'] = self.filter
+        return pickle.dumps(d)
+
+    def _manifest_entry(self):
+        """ Everything Block.open reads, for the manifest of the tree """
+        streams = {}
+        for stream, subshape in self.streams.values():
+            streams[os.path.basename(stream.datafilename)] = \
+                    (stream._load_index(), stream.zonemap(),
+                     stream._load_checksums())
+        if self._metadata is not None:
+            metadata = json.dumps(self._metadata, sort_keys=True)
+        else:
+            # no need to parse the header just to copy it
+            if self._metadatajson is None:
+                self._metadatajson = _load_cached(self.metadatafilename,
+                        lambda ff: ff.read())
+            metadata = self._metadatajson or '{}'
+        return {'dtype' : pickle.loads(self._dumps()),
+                'metadata' : metadata, 'streams' : streams}
+
+    def _setup_streams(self):
+        """ The compressed streams holding the data: one for
+            the flat layout, one per field for the columns layout.
+            streams maps the field name (None for flat) to the
+            stream and the shape of the field within a row.
+
+            The tiles layout has a single stream of tiles of shape
+            tiles, in C order of the grid of tiles covering the
+            block; the tiles at the edges are padded with zeros. """
+        self.streams = {}
+        if self.dtype is None:
+            return
+        if self.layout == 'flat':
+            self.streams[None] = (Stream(os.path.join(self.path,
+                    'data.bin.' + self.codec), self.dtype, self.mmap,
+                    self.codec, self._stream_block_size(None),
+                    self.checksums, self._stream_filter(self.dtype, ())),
+                    ())
+        elif self.layout == 'tiles':
+            self.streams[None] = (Stream(os.path.join(self.path,
+                    'tiles.bin.' + self.codec), self.dtype, self.mmap,
+                    self.codec, self._stream_block_size(None),
+                    self.checksums, self._stream_filter(self.dtype, ())),
+                    ())
+        elif self.layout == 'columns':
+            for i, name in enumerate(self.dtype.names):
+                fdtype = self.dtype.fields[name][0]
+                filename = os.path.join(self.path,
+                        'column-%04d.bin.%s' % (i, self.codec))
+                self.streams[name] = (Stream(filename,
+                        fdtype.base, self.mmap, self.codec,
+                        self._stream_block_size(name), self.checksums,
+                        self._stream_filter(fdtype.base, fdtype.shape)),
+                        fdtype.shape)
+        else:
+            raise ValueError("unknown layout %s" % self.layout)
+
+    def _stream_filter(self, dtype, subshape):
+        """ The filter of a stream of dtype, subshape elements per
+            row of the block, as the name and distance for the
+            compressor, or None. Only numbers are filtered: integers
+            by their difference unless the filter is xor, floats by
+            the xor of their bits; each element with the one of the
+            last row for rows, or else the last of the same field. """
+        if self.filter is None or dtype.kind not in 'iuf' \
+            or dtype.shape != () or dtype.itemsize not in (1, 2, 4, 8):
+            return None
+        name = 'delta'
+        if self.filter == 'xor' or dtype.kind == 'f':
+            name = 'xor'
+        distance = int(numpy.prod(subshape))
+        if self.filter == 'rows':
+            shape = self.tiles if self.layout == 'tiles' else self.shape
+            distance *= int(numpy.prod(shape[1:]))
+        return name, max(distance, 1)
+
+    def _stream_block_size(self, name):
+        """ The block size of the stream of field name; None for
+            the default of its dtype. block_size is None, a number
+            for all streams, 'auto' until the data is written, and
+            then the sizes picked for each stream by name. """
+        if isinstance(self.block_size, dict):
+            return self.block_size.get(name)
+        if self.block_size == 'auto':
+            return None
+        return self.block_size
+
+    def _autotune(self, rows):
+        """ Pick the block size of each stream from the first
+            rows written. """
+        block_size = {}
+        for name, (stream, subshape) in self.streams.items():
+            sample = rows if name is None else rows[name]
+            stream.set_block_size(_autotune_block_size(sample,
+                    stream.codec, filter=stream.filter))
+            block_size[name] = stream.block_size
+        self.block_size = block_size
+
     def __enter__(self):
         return self
 
@@ -40,58 +228,1123 @@ class Block(object):
         self.flush()
 
     def flush(self):
-        with file(self.dtypefilename, 'w') as ff:
-            d = {}
-            d['dtype'] = self.dtype
-            d['shape'] = self.shape
-            pickle.dump(d, ff)
-        with file(self.metadatafilename, 'w') as ff:
-            json.dump(self.metadata, ff)
+        """ Write dtype.pickle and meta.json, if they changed. """
+        if self._writing:
+            self._end_write()
+        changed = False
+        if 'dtype' in self.__dict__:
+            flushed = self._dumps()
+            if flushed != self._flushed_dtype:
+                _replace(self.dtypefilename, lambda ff: ff.write(flushed))
+                # the key may not change with a coarse mtime
+                cache.default.evict(self.dtypefilename)
+                self._flushed_dtype = flushed
+                changed = True
+        if self._metadata is not None:
+            flushed = json.dumps(self._metadata, sort_keys=True)
+            if flushed != self._flushed_metadata:
+                with file(self.metadatafilename, 'w') as ff:
+                    ff.write(flushed)
+                cache.default.evict(self.metadatafilename)
+                self._flushed_metadata = flushed
+                changed = True
+        if changed:
+            _remove_manifest(self.path)
 
     def __getitem__(self, index):
-        assert index is Ellipsis
+        if isinstance(index, basestring):
+            return self.read(columns=index)
+        if isinstance(index, (tuple, list)) and len(index) > 0 \
+            and all(isinstance(i, basestring) for i in index):
+            return self.read(columns=list(index))
+        return self.read(index)
+
+    def read(self, index=Ellipsis, out=None, columns=None):
+        """ Read block[index]. If out is given, the data is stored into
+            out, decompressing straight into it when index selects
+            whole rows and out is C-contiguous.
+
+            columns is a field name or a list of names, to read only
+            these fields of a table; with the columns layout
+            the other fields are not even decompressed. """
         if self.dtype is None:
             return None
-        with file(self.datafilename, 'r') as ff:
-            compressed = numpy.fromfile(ff, dtype='uint8')
-            data = bitshuffle.decompress_lz4(compressed, 
-                    self.shape, self.dtype)
-            #data = data.reshape(self.shape)
-            return data
+        if self.layout == 'tiles':
+            data = self._read_tiles(index)
+            if columns is not None:
+                data = data[columns]
+        elif len(self.shape) == 0:
+            data = self._read_rows(0, 1, columns=columns)
+            data = data.reshape(data.shape[1:])[index]
+        else:
+            if not isinstance(index, tuple):
+                index = (index,)
+            if len(index) == 0 or index[0] is Ellipsis:
+                lo, hi = 0, self.shape[0]
+            else:
+                lo, hi, sub = _rowindex(index[0], self.shape[0])
+                index = (sub,) + index[1:]
+            if out is not None and all(_isfull(i) for i in index):
+                return self._read_rows(lo, hi, out, columns)
+            data = self._read_rows(lo, hi, columns=columns)[index]
+        if out is not None:
+            out[...] = data
+            return out
+        return data
 
     def __setitem__(self, index, value):
         assert index is Ellipsis
         assert self.dtype is not None
-        data = numpy.empty(self.shape, self.dtype)
-        data[...] = value
-        with file(self.datafilename, 'w') as ff:
-            compressed = bitshuffle.compress_lz4(data)
-            compressed.tofile(ff)
+        self._begin_write()
+        if len(self.shape) == 0:
+            self._write_rows(numpy.asarray(value, self.dtype).reshape(1))
+        elif numpy.shape(value) == tuple(self.shape):
+            self.write_chunk(value)
+        else:
+            # broadcast value a bounded number of rows at a time
+            rows = numpy.empty((min(self.shape[0], _rows_per_chunk(self)),)
+                    + tuple(self.shape[1:]), self.dtype)
+            rows[...] = value
+            for lo in range(0, self.shape[0], max(len(rows), 1)):
+                self.write_chunk(rows[:self.shape[0] - lo])
+        self._end_write()
+
+    def write_chunk(self, rows):
+        """ Append rows to the data, compressing them as they arrive,
+            so a block larger than memory can be written a chunk of
+            rows at a time. The data is complete once all
+            shape[0] rows are written and the block is flushed. """
+        assert self.dtype is not None
+        rows = self._as_rows(rows)
+        if not self._writing:
+            self._begin_write()
+        if self._nwritten + len(rows) > self.shape[0]:
+            raise ValueError("too many rows for a block of shape %s"
+                    % (self.shape,))
+        self._write_rows(rows)
+
+    def append(self, rows):
+        """ Append rows to the block, growing shape[0]. Only the new
+            rows and the last chunk of each stream, if partial, are
+            compressed; the chunks before it are kept as they are, so
+            adding a few rows to a large table does not rewrite it.
+
+            The new chunks are written after the end of the data
+            files, none of the bytes there already is changed; then the
+            chunk indexes, zone maps and checksums are replaced, and the
+            shape in dtype.pickle last, each by a rename. A reader
+            holding the old index, or opening the block meanwhile,
+            still reads the old rows. The bytes of the replaced last
+            chunk stay in the data file, unused, until the block is
+            written again. Not for tiled or scalar blocks. """
+        if self.dtype is None or len(self.shape) == 0 \
+            or self.layout == 'tiles':
+            raise ValueError("append needs rows of a flat or columns"
+                    " block")
+        if self._writing:
+            raise ValueError("block at %s is being written" % self.path)
+        rows = self._as_rows(rows)
+        nrows = self.shape[0]
+        shape = (nrows + len(rows),) + tuple(self.shape[1:])
+        if self.unwritten:
+            # nothing to keep; the rows so far are zeros
+            self.shape = shape
+            self._begin_write()
+            zeros = numpy.zeros((min(nrows, _rows_per_chunk(self)),)
+                    + shape[1:], self.dtype)
+            for lo in range(0, nrows, max(len(zeros), 1)):
+                self._write_rows(zeros[:nrows - lo])
+            self._write_rows(rows)
+            self._end_write()
+        elif len(rows):
+            rowsize = int(numpy.prod(shape[1:]))
+            for name, (stream, subshape) in self.streams.items():
+                stream.append(rows if name is None else rows[name],
+                        nrows * rowsize * int(numpy.prod(subshape)))
+            _remove_manifest(self.path)
+            self.shape = shape
+        self.flush()
+
+    def _as_rows(self, rows):
+        """ rows as an array of rows of the block; numbers in the
+            other byte order are kept, the compressor swaps them. """
+        rowshape = tuple(self.shape[1:])
+        rows = numpy.asarray(rows)
+        if rows.dtype.newbyteorder('S') != self.dtype:
+            rows = numpy.asarray(rows, self.dtype)
+        if rows.shape[1:] != rowshape:
+            raise ValueError("rows have shape %s, expecting (n,) + %s"
+                    % (rows.shape, rowshape))
+        return rows
+
+    def _write_rows(self, rows):
+        if self.block_size == 'auto' and len(rows):
+            self._autotune(rows)
+        if self.layout == 'tiles':
+            self._write_band(rows)
+            return
+        for name, (stream, subshape) in self.streams.items():
+            if name is None:
+                stream.write(rows)
+            else:
+                stream.write(rows[name])
+        self._nwritten += len(rows)
+
+    def _begin_write(self):
+        for stream, subshape in self.streams.values():
+            stream.begin_write()
+        self._writing = True
+        self._nwritten = 0
+        self.unwritten = False
+        if self.layout == 'tiles':
+            # the band of tiles being filled, padded to whole tiles.
+            grid = self._tilegrid()
+            self._band = numpy.zeros(
+                [g * t for g, t in zip((1,) + grid[1:], self.tiles)],
+                self.dtype)
+            self._bandrows = 0
+
+    def _end_write(self):
+        self._writing = False
+        if self.layout == 'tiles':
+            if self._bandrows > 0:
+                self._band[self._bandrows:] = 0
+                self._flush_band()
+            self._band = None
+        for stream, subshape in self.streams.values():
+            stream.end_write()
+        _remove_manifest(self.path)
+        nrows = self.shape[0] if len(self.shape) else 1
+        if self._nwritten != nrows:
+            raise ValueError("%d of %d rows written"
+                    % (self._nwritten, nrows))
+
+    def _read_rows(self, lo, hi, out=None, columns=None):
+        """ Decompress rows lo to hi of the columns, touching only
+            the chunks holding them if the streams have an index. """
+        if self.layout == 'flat':
+            if columns is None:
+                return self._read_stream(None, lo, hi, out)
+            data = self._read_stream(None, lo, hi)[columns]
+            if out is not None:
+                out[...] = data
+                return out
+            return data
+
+        if isinstance(columns, basestring):
+            return self._read_stream(columns, lo, hi, out)
+        if columns is None:
+            dtype = self.dtype
+        else:
+            dtype = numpy.dtype([(name, self.dtype.fields[name][0])
+                for name in columns])
+        shape = (hi - lo,) + tuple(self.shape[1:])
+        if out is None:
+            out = numpy.empty(shape, dtype)
+        elif out.shape != shape:
+            raise ValueError("out has shape %s, expecting %s"
+                    % (out.shape, shape))
+        for name in dtype.names:
+            self._read_stream(name, lo, hi, out[name])
+        return out
+
+    def _read_stream(self, name, lo, hi, out=None):
+        """ Rows lo to hi of the stream of field name. """
+        if name not in self.streams:
+            raise ValueError("no field named %s" % name)
+        stream, subshape = self.streams[name]
+        rowshape = tuple(self.shape[1:]) + tuple(subshape)
+        rowsize = int(numpy.prod(rowshape))
+        shape = (hi - lo,) + rowshape
+        if out is not None and out.shape != shape:
+            raise ValueError("out has shape %s, expecting %s"
+                    % (out.shape, shape))
+        if self.unwritten:
+            if out is None:
+                out = numpy.empty(shape, stream.dtype)
+            out[...] = 0
+            return out
+        size = int(numpy.prod(self.shape)) * int(numpy.prod(subshape))
+        if out is None:
+            # through the chunk cache
+            return stream.read(lo * rowsize, hi * rowsize, size).reshape(shape)
+        return stream.read(lo * rowsize, hi * rowsize, size, out)
+
+    def where(self, column, lo=None, hi=None):
+        """ Rows where lo <= block[column] <= hi, as an array of row
+            numbers; lo or hi None is unbounded, NaNs never match.
+
+            Only the chunks whose zone map (the min and max recorded
+            when the block was written) overlaps [lo, hi] are
+            decompressed. column is None for a block without fields. """
+        if self.dtype is None or self.layout == 'tiles' \
+            or len(self.shape) != 1:
+            raise ValueError("where needs a one dimensional block")
+        if column not in self.streams:
+            if column in (self.dtype.names or ()):
+                # flat layout, no zone map for fields of records.
+                data = self._read_rows(0, self.shape[0], columns=column)
+                return _match(data, lo, hi).nonzero()[0]
+            raise ValueError("no field named %s" % column)
+        stream, subshape = self.streams[column]
+        if subshape != ():
+            raise ValueError("where needs a scalar field")
+        nrows = self.shape[0]
+        zonemap = None if self.unwritten else stream.zonemap()
+        if zonemap is None:
+            data = self._read_stream(column, 0, nrows)
+            return _match(data, lo, hi).nonzero()[0]
+
+        bs = stream.block_size
+        keep = numpy.ones(len(zonemap), dtype='?')
+        if lo is not None:
+            keep &= zonemap['max'] >= lo
+        if hi is not None:
+            keep &= zonemap['min'] <= hi
+        # fmin/fmax of a chunk of only NaNs are NaN
+        keep &= zonemap['nnan'] < numpy.diff(
+                numpy.minimum(numpy.arange(len(zonemap) + 1) * bs, nrows))
+        rows = []
+        # decompress each run of consecutive candidate chunks at once
+        edges = numpy.diff(numpy.concatenate([[0], keep, [0]]).astype('i1'))
+        for c0, c1 in zip((edges == 1).nonzero()[0],
+                (edges == -1).nonzero()[0]):
+            r0, r1 = c0 * bs, min(c1 * bs, nrows)
+            data = self._read_stream(column, r0, r1)
+            rows.append(_match(data, lo, hi).nonzero()[0] + r0)
+        if len(rows) == 0:
+            return numpy.empty(0, dtype='intp')
+        return numpy.concatenate(rows)
+
+    def _tilegrid(self):
+        """ Number of tiles along each axis. """
+        return tuple(-(-n // t) for n, t in zip(self.shape, self.tiles))
+
+    def _write_band(self, rows):
+        """ Collect rows into the band of tiles, compressing the tiles
+            of the band once it is full. """
+        while len(rows):
+            n = min(self.tiles[0] - self._bandrows, len(rows))
+            box = (slice(self._bandrows, self._bandrows + n),) + \
+                    tuple(slice(0, m) for m in self.shape[1:])
+            self._band[box] = rows[:n]
+            self._bandrows += n
+            self._nwritten += n
+            rows = rows[n:]
+            if self._bandrows == self.tiles[0]:
+                self._flush_band()
+
+    def _flush_band(self):
+        stream, subshape = self.streams[None]
+        grid = self._tilegrid()
+        for coord in itertools.product(*[range(g) for g in grid[1:]]):
+            tile = (slice(None),) + tuple(slice(c * t, (c + 1) * t)
+                    for c, t in zip(coord, self.tiles[1:]))
+            stream.write(self._band[tile])
+        self._bandrows = 0
+
+    def _read_tiles(self, index):
+        """ block[index] of a tiled block, decompressing only
+            the tiles overlapping the bounding box of index. Integer
+            arrays index their axis independently, like numpy.ix_. """
+        index = _expand_index(index, len(self.shape))
+        lo, hi, sub = zip(*[_rowindex(i, n)
+                for i, n in zip(index, self.shape)])
+        box = numpy.empty([h - l for l, h in zip(lo, hi)], self.dtype)
+        if self.unwritten:
+            box[...] = 0
+        else:
+            stream, subshape = self.streams[None]
+            grid = self._tilegrid()
+            tilesize = int(numpy.prod(self.tiles))
+            size = int(numpy.prod(grid)) * tilesize
+            for coord in itertools.product(*[range(l // t, -(-h // t))
+                    for l, h, t in zip(lo, hi, self.tiles)]):
+                i = int(numpy.ravel_multi_index(coord, grid))
+                tile = stream.read(i * tilesize, (i + 1) * tilesize,
+                        size).reshape(self.tiles)
+                # intersection of the tile and the box
+                g0 = [max(c * t, l) for c, t, l in zip(coord, self.tiles, lo)]
+                g1 = [min((c + 1) * t, h)
+                        for c, t, h in zip(coord, self.tiles, hi)]
+                box[tuple(slice(a - l, b - l)
+                    for a, b, l in zip(g0, g1, lo))] = \
+                tile[tuple(slice(a - c * t, b - c * t)
+                    for a, b, c, t in zip(g0, g1, coord, self.tiles))]
+        # pick the elements of index from the box, an axis at a time
+        # from the last so integers dropping an axis do not shift the
+        # axes still to do.
+        for axis in reversed(range(len(sub))):
+            if not _isfull(sub[axis]):
+                box = box[(slice(None),) * axis + (sub[axis],)]
+        return box
 
     @classmethod
-    def create(kls, path, shape, dtype):
+    def create(kls, path, shape, dtype, layout=None, tiles=None,
+            codec='bslz4', block_size=None, native=False, checksums=False,
+            filter=None):
+        """ Create an unwritten block. layout is 'flat', where rows are
+            compressed whole, or 'columns', where each field of a
+            table has its own stream; the default is columns for
+            dtypes with fields. Passing the shape of the tiles
+            selects the 'tiles' layout, where block[index] only
+            decompresses tiles overlapping index. codec is one
+            of CODECS. With native the data is stored, and read, in
+            the byte order of this machine, whatever the order of
+            dtype; the swap is fused into compressing the numbers.
+
+            block_size is the number of elements compressed as
+            a unit, and the least read to get any of them; larger
+            compress better, smaller make reading a few rows
+            cheaper. None is about 8 KB, 'auto' picks for each
+            stream the size compressing the first rows written best
+            without slowing decompression, see _autotune_block_size.
+
+            With checksums the CRC32C of every compressed chunk is
+            stored next to the chunk index, and the chunks are
+            verified as they are decompressed; corrupt data raises
+            an IOError instead of decompressing to garbage.
+
+            filter is one of FILTERS, for the bitshuffle codecs:
+            numbers are stored as their difference to the one before,
+            which bitshuffle compresses much better for sorted
+            columns and smooth images. 'delta' subtracts integers
+            and xors the bits of floats, 'xor' xors all numbers, and
+            'rows' takes the element of the row before, for images;
+            it only helps with a block_size of more than a row of
+            the image, or of the tiles. """
+        if codec not in CODECS:
+            raise ValueError("unknown codec %s" % codec)
+        if filter not in FILTERS:
+            raise ValueError("unknown filter %s" % filter)
+        if filter is not None and codec not in ('bslz4', 'bszlib'):
+            raise ValueError("filter %s needs a bitshuffle codec, not %s"
+                    % (filter, codec))
+        if block_size not in (None, 'auto') and (
+                not isinstance(block_size, (int, long))
+                or block_size <= 0 or block_size % 8):
+            raise ValueError("block_size %s is not a positive multiple"
+                    " of 8" % (block_size,))
         self = kls(path)
+        try:
+            os.makedirs(self.path)
+        except OSError:
+            pass
+        if not os.path.exists(self.path):
+            raise IOError("path %s not avalable" % self.path)
+
         if dtype is not None:
             dtype = numpy.dtype(dtype)
+            if native:
+                dtype = dtype.newbyteorder('=')
         self.dtype = dtype
         if shape is not None:
             shape = tuple(shape)
         self.shape = shape
-        if dtype is not None:
-            self[...] = 0
+        if tiles is not None:
+            tiles = tuple(int(t) for t in tiles)
+            if shape is None or len(tiles) != len(shape) \
+                or len(tiles) == 0 or min(tiles) <= 0:
+                raise ValueError("tiles %s do not fit shape %s"
+                        % (tiles, shape))
+            layout = 'tiles'
+        self.tiles = tiles
+        if layout is None:
+            if dtype is not None and dtype.names:
+                layout = 'columns'
+            else:
+                layout = 'flat'
+        self.layout = layout
+        self.codec = codec
+        self.block_size = block_size
+        self.checksums = bool(checksums)
+        self.filter = filter
+        self._metadata = {}
+        self._setup_streams()
+        # nothing is written until the data is; the block reads as zeros.
+        for filename in os.listdir(self.path):
+            if '.bin.' in filename:
+                os.remove(os.path.join(self.path, filename))
+        self.unwritten = dtype is not None
         self.flush()
         return self
 
+class Stream(object):
+    """ A compressed stream of elements: the data file, the index
+        of its chunks, datafilename + '.index', and for numbers
+        the zone map of the chunks, datafilename + '.zonemap'.
+        codec is one of CODECS; block_size None is the default
+        of the dtype. With checksums the CRC32C of the compressed
+        bytes of each chunk is in datafilename + '.crc32c'. filter
+        is the name and distance of the filter of the numbers of
+        each chunk, see Block._stream_filter, or None. """
+    def __init__(self, datafilename, dtype, mmap=True, codec='bslz4',
+            block_size=None, checksums=False, filter=None):
+        self.datafilename = datafilename
+        self.codec = codec
+        self.checksums = checksums
+        self.filter = filter
+        self.indexfilename = datafilename + '.index'
+        self.zonemapfilename = datafilename + '.zonemap'
+        self.checksumfilename = datafilename + '.crc32c'
+        self.dtype = numpy.dtype(dtype)
+        self.mmap = mmap
+        self._index = None
+        self._zonemap = None
+        self._checksums = None
+        self._writer = None
+        self.stats = collections.Counter()
+        self.set_block_size(block_size)
+
+    def set_block_size(self, block_size):
+        """ Change the block size, before any element is written """
+        if block_size is None:
+            block_size = bitshuffle.default_block_size(self.dtype.itemsize)
+        self.block_size = block_size
+        if self._writer is not None:
+            assert self._writer.nbytes == 0 and len(self._writer.tail) == 0
+            self._writer.block_size = block_size
+
+    def begin_write(self):
+        if self._writer is not None:
+            self._writer.close()
+        for filename in (self.datafilename, self.indexfilename,
+                self.zonemapfilename, self.checksumfilename):
+            cache.default.evict(filename)
+        self._writer = ChunkWriter(self.datafilename,
+                self.indexfilename, self.dtype, self.zonemapfilename,
+                self.codec, self.block_size, self.checksumfilename,
+                self.checksums, filter=self.filter)
+        self._index = None
+        self._zonemap = None
+        self._checksums = None
+
+    def write(self, elements):
+        self._writer.write(elements)
+
+    def end_write(self):
+        writer, self._writer = self._writer, None
+        self._index = writer.close()
+        self.stats.update(writer.stats)
+
+    def append(self, elements, size):
+        """ Append elements to the size elements of the stream. The
+            last chunk, if partial, is decompressed and compressed
+            again with the new elements, after the end of the data
+            file; the chunks before it are not touched. """
+        index = self._load_index()
+        if index is None:
+            raise IOError("%s has no index" % self.indexfilename)
+        checksums = self._load_checksums()
+        if self.checksums and checksums is None:
+            raise IOError("%s has no checksums" % self.checksumfilename)
+        zonemap = self.zonemap()
+        keep = size // self.block_size
+        tail = self._decompress(index, keep, len(index) - 1, size) \
+                if keep < len(index) - 1 else None
+        for filename in (self.datafilename, self.indexfilename,
+                self.zonemapfilename, self.checksumfilename):
+            cache.default.evict(filename)
+        writer = ChunkWriter(self.datafilename,
+                self.indexfilename, self.dtype, self.zonemapfilename,
+                self.codec, self.block_size, self.checksumfilename,
+                self.checksums, keep=(index[:keep + 1],
+                    None if zonemap is None else zonemap[:keep],
+                    None if checksums is None else checksums[:keep]),
+                filter=self.filter)
+        if tail is not None:
+            writer.write(tail)
+        writer.write(elements)
+        self._index = writer.close()
+        self._zonemap = None
+        self._checksums = None
+        self.stats.update(writer.stats)
+
+    def preload(self, index, zonemap, checksums=None):
+        """ Use the index, zone map and checksums from the manifest
+            of the tree """
+        self._index = index
+        self._zonemap = zonemap
+        self._checksums = checksums
+
+    def _load_index(self):
+        if self._index is None:
+            self._index = _load_cached(self.indexfilename,
+                    lambda ff: numpy.fromfile(ff, dtype='<u8'))
+            # with the index, before an append replaces them
+            self._load_checksums()
+        return self._index
+
+    def _load_checksums(self):
+        """ The checksums of the chunks, None without them """
+        if self._checksums is None and self.checksums:
+            self._checksums = _load_cached(self.checksumfilename,
+                    lambda ff: numpy.fromfile(ff, dtype='<u4'))
+        return self._checksums
+
+    def zonemap(self):
+        """ min, max and nnan (the number of NaNs) of the elements
+            in each chunk, None if the stream has no zone map. min
+            and max skip NaNs; they are NaN if the whole chunk is. """
+        if self._zonemap is None:
+            self._zonemap = _load_cached(self.zonemapfilename, numpy.load)
+        return self._zonemap
+
+    def _read_compressed(self, offset, nbytes):
+        """ Compressed bytes of the data file. With mmap the pages are
+            faulted in by the decompressor instead of copied to
+            the heap first. """
+        if self.mmap:
+            return numpy.memmap(self.datafilename, dtype='uint8',
+                    mode='r', offset=offset, shape=(nbytes,))
+        with file(self.datafilename, 'r') as ff:
+            ff.seek(offset)
+            return numpy.fromfile(ff, dtype='uint8', count=nbytes)
+
+    def read(self, start, end, size, out=None):
+        """ Decompress elements start to end of the size elements
+            into out, or a new array, touching only the chunks
+            holding them if there is an index. Whole chunks are
+            decompressed straight into a C-contiguous out; small
+            reads without out go through the chunk cache. """
+        given = out is not None
+        if out is None:
+            out = numpy.empty(end - start, self.dtype)
+        if start == end:
+            return out
+        index = self._load_index()
+
+        if index is None:
+            data = self._decompress(None, 0, None, size)
+            out[...] = data[start:end].reshape(out.shape)
+            return out
+
+        bs = self.block_size
+        c0 = start // bs
+        c1 = min(-(-end // bs), len(index) - 1)
+        first = c0 * bs
+        count = min(c1 * bs, size) - first
+
+        direct = first == start and count == end - start \
+            and out.dtype == self.dtype and out.flags['C_CONTIGUOUS']
+        small = 8 * count * self.dtype.itemsize <= cache.default.nbytes \
+            and os.path.exists(self.datafilename)
+        if direct and (given or not small):
+            return self._decompress(index, c0, c1, size, out.reshape(-1))
+        elif small:
+            data = numpy.concatenate(self._cached_chunks(index, c0, c1, size))
+        else:
+            data = self._decompress(index, c0, c1, size)
+        out[...] = data[start - first:end - first].reshape(out.shape)
+        return out
+
+    def _cached_chunks(self, index, c0, c1, size):
+        """ Decompressed chunks c0 to c1, from the cache where
+            possible; missed runs of chunks are decompressed at
+            once and added to the cache. A chunk is keyed by its
+            offset too, which changes when an append replaces it. """
+        bs = self.block_size
+        key = cache.filekey(self.datafilename)
+        chunks = [cache.default.get(key + (c, int(index[c])))
+                for c in range(c0, c1)]
+        c = c0
+        while c < c1:
+            if chunks[c - c0] is not None:
+                c += 1
+                continue
+            d = c
+            while d < c1 and chunks[d - c0] is None:
+                d += 1
+            data = self._decompress(index, c, d, size)
+            for k in range(c, d):
+                chunk = data[(k - c) * bs:(k + 1 - c) * bs].copy()
+                chunk.flags.writeable = False
+                cache.default.put(key + (k, int(index[k])), chunk,
+                        chunk.nbytes)
+                chunks[k - c0] = chunk
+            c = d
+        return chunks
+
+    def _decompress(self, index, c0, c1, size, out=None):
+        """ Decompress the elements of chunks c0 to c1; with no index
+            (c1 is None) all of them. """
+        bs = self.block_size
+        checksums = self._load_checksums()
+        if self.checksums and checksums is None:
+            raise IOError("%s has no checksums" % self.checksumfilename)
+        t0 = time.time()
+        if c1 is None:
+            count, offsets = size, None
+            compressed = self._read_compressed(0,
+                    os.path.getsize(self.datafilename))
+        else:
+            count, offsets = min(c1 * bs, size) - c0 * bs, \
+                    index[c0:c1 + 1] - index[c0]
+            compressed = self._read_compressed(int(index[c0]),
+                    int(index[c1] - index[c0]))
+            if checksums is not None:
+                checksums = checksums[c0:c1]
+        t1 = time.time()
+        try:
+            data = _decode(self.codec, compressed, count, self.dtype, bs,
+                    out, offsets, checksums, self.filter)
+        except IOError as e:
+            if e.errno != _CORRUPT:
+                raise
+            raise IOError(e.errno, e.strerror, self.datafilename)
+        self.stats['read_time'] += t1 - t0
+        self.stats['read_bytes'] += len(compressed)
+        self.stats['decode_time'] += time.time() - t1
+        self.stats['decoded_bytes'] += data.nbytes
+        return data
+
+class ChunkWriter(object):
+    """ Compress a stream of elements into a data file and its chunk
+        index. The elements are compressed as soon as a whole chunk of
+        block_size elements is there, only the tail of a partial
+        chunk is held back; the file is identical to compressing all
+        the elements at once.
+
+        For numbers the min, max and NaN count of every chunk are
+        collected on the way, and written to zonemapfilename.
+        With checksums the CRC32C of every compressed chunk is
+        computed as it is compressed, and written to checksumfilename.
+
+        Elements are compressed a segment of about segment_nbytes at
+        a time, so the compressed buffer of a HDU of many GB does
+        not need as much memory again. All chunks decompress
+        independently, the segments leave no trace in the file.
+
+        keep is the index, zone map and checksums of whole chunks
+        already in the data file, to append after them. The new
+        chunks are written after the end of the file, whatever is
+        there, so readers of the old index still find their bytes;
+        the last chunk kept then ends where the new ones start, with
+        the unused bytes in between, and its checksum covers them.
+        The index, zone map and checksum files are replaced by a
+        rename when closing. filter is that of the stream, see
+        Stream. """
+    segment_nbytes = 256 * 1024 * 1024
+
+    def __init__(self, datafilename, indexfilename, dtype,
+            zonemapfilename=None, codec='bslz4', block_size=None,
+            checksumfilename=None, checksums=False, keep=None,
+            filter=None):
+        self.dtype = dtype
+        self.codec = codec
+        self.filter = filter
+        if block_size is None:
+            block_size = bitshuffle.default_block_size(dtype.itemsize)
+        self.block_size = block_size
+        self.indexfilename = indexfilename
+        self.zonemapfilename = zonemapfilename
+        self.checksumfilename = checksumfilename
+        self.checksums = None
+        if checksumfilename is not None and checksums:
+            self.checksums = []
+        self.tail = numpy.empty(0, dtype)
+        self.stats = collections.Counter()
+        self.zonemap = None
+        if zonemapfilename is not None and dtype.kind in 'iuf' \
+            and dtype.shape == ():
+            self.zonemap = []
+        if keep is None:
+            self.ff = file(datafilename, 'w')
+            self.nbytes = 0
+            self.index = [numpy.zeros(1, dtype='u8')]
+            return
+        index, zonemap, checksums = keep
+        self.ff = file(datafilename, 'r+b')
+        self.ff.seek(0, 2)
+        self.nbytes = self.ff.tell()
+        index = numpy.array(index, dtype='u8')
+        if self.checksums is not None:
+            checksums = numpy.array(checksums, dtype='u4')
+            if len(index) > 1 and index[-1] != self.nbytes:
+                # the last chunk kept now runs to the end of the file
+                self.ff.seek(int(index[-2]))
+                data = numpy.fromfile(self.ff, dtype='u1',
+                        count=self.nbytes - int(index[-2]))
+                self.ff.seek(0, 2)
+                checksums[-1:] = bitshuffle.crc32c_chunks(data,
+                        numpy.array([0, len(data)], dtype='u8'))
+            self.checksums.append(checksums)
+        index[-1] = self.nbytes
+        self.index = [index]
+        if self.zonemap is not None:
+            if zonemap is not None:
+                self.zonemap.append(zonemap)
+            elif len(index) > 1:
+                # chunks kept without a zone map, have none
+                self.zonemap = None
+
+    def write(self, elements):
+        """ Numbers in the other byte order are swapped as they are
+            compressed, without a pass of their own. Evenly spaced
+            elements, such as a column of a table, are gathered by the
+            compressor, not copied first. """
+        elements = numpy.asarray(elements)
+        if not _swappable(elements.dtype, self.dtype):
+            elements = numpy.asarray(elements, self.dtype)
+        # a view where the elements stay evenly spaced
+        elements = elements.reshape(-1)
+        bs = self.block_size
+        if len(self.tail):
+            n = min(bs - len(self.tail), len(elements))
+            self.tail = numpy.concatenate([self.tail,
+                elements[:n].astype(self.dtype)])
+            elements = elements[n:]
+            if len(self.tail) < bs:
+                return
+            self._compress(self.tail)
+        n = len(elements) // bs * bs
+        step = max(self.segment_nbytes // (bs * self.dtype.itemsize), 1) * bs
+        for lo in range(0, n, step):
+            self._compress(elements[lo:min(lo + step, n)])
+        self.tail = elements[n:].astype(self.dtype)
+
+    def _compress(self, elements):
+        t0 = time.time()
+        compressed, offsets, checksums = _encode(self.codec, elements,
+                self.block_size, elements.dtype != self.dtype,
+                self.checksums is not None, self.filter)
+        t1 = time.time()
+        if checksums is not None:
+            self.checksums.append(checksums)
+        compressed.tofile(self.ff)
+        self.stats['encode_time'] += t1 - t0
+        self.stats['encoded_bytes'] += elements.nbytes
+        self.stats['write_time'] += time.time() - t1
+        self.stats['written_bytes'] += len(compressed)
+        self.index.append(offsets[1:] + self.nbytes)
+        self.nbytes += len(compressed)
+        if self.zonemap is not None:
+            self.zonemap.append(_zonemap(elements, self.block_size))
+
+    def close(self):
+        """ Compress the tail, and write the index. Returns the index """
+        if len(self.tail):
+            self._compress(self.tail)
+            self.tail = self.tail[:0]
+        self.ff.close()
+        index = numpy.concatenate(self.index)
+        _replace(self.indexfilename, index.astype('<u8').tofile)
+        if self.zonemap is not None:
+            if len(self.zonemap):
+                zonemap = numpy.concatenate(self.zonemap)
+            else:
+                zonemap = _zonemap(self.tail[:0], self.block_size)
+            _replace(self.zonemapfilename,
+                    lambda ff: numpy.save(ff, zonemap))
+        elif self.zonemapfilename is not None \
+            and os.path.exists(self.zonemapfilename):
+            os.remove(self.zonemapfilename)
+        if self.checksums is not None:
+            _replace(self.checksumfilename, numpy.concatenate(
+                [numpy.zeros(0, 'u4')] + self.checksums).astype('<u4').tofile)
+        elif self.checksumfilename is not None \
+            and os.path.exists(self.checksumfilename):
+            os.remove(self.checksumfilename)
+        return index
+
+def _encode(codec, elements, block_size, byteswap=False, checksums=False,
+        filter=None):
+    """ Compress the elements with codec, byte swapped if byteswap.
+        Returns the bytes, the offsets of the chunks of block_size
+        elements in them and, if checksums, the CRC32C of each chunk,
+        else None. filter is the name and distance of the filter of
+        the bitshuffle codecs, or None. """
+    itemsize = elements.dtype.itemsize
+    crcs = None
+    if checksums:
+        crcs = numpy.empty(-(-elements.size // block_size), dtype='u4')
+    name, distance = filter or (None, 1)
+    if codec == 'bslz4':
+        compressed = bitshuffle.compress_lz4(elements, block_size,
+                byteswap=byteswap, checksums=crcs, filter=name,
+                distance=distance)
+    elif codec == 'bszlib':
+        compressed = bitshuffle.compress_zlib(elements, block_size,
+                byteswap=byteswap, checksums=crcs, filter=name,
+                distance=distance)
+    else:
+        # chunks of fixed size
+        elements = numpy.ascontiguousarray(elements)
+        if codec == 'bitshuffle':
+            elements = bitshuffle.bitshuffle(elements, block_size,
+                    byteswap=byteswap)
+        elif byteswap:
+            elements = elements.byteswap()
+        offsets = _fixed_offsets(elements.size, itemsize, block_size)
+        compressed = elements.view('u1')
+        if checksums:
+            crcs = bitshuffle.crc32c_chunks(compressed, offsets)
+        return compressed, offsets, crcs
+    return compressed, bitshuffle.lz4_chunk_offsets(compressed,
+            elements.size, itemsize, block_size), crcs
+
+def _fixed_offsets(size, itemsize, block_size):
+    """ Offsets of the chunks of size elements stored as they are """
+    offsets = numpy.arange(0, size + block_size, block_size)
+    return (numpy.minimum(offsets, size) * itemsize).astype('u8')
+
+# errno of the IOError raised for data not matching its checksums; the
+# error code of the compressor.
+_CORRUPT = -92
+
+def _decode(codec, compressed, count, dtype, block_size, out=None,
+        offsets=None, checksums=None, filter=None):
+    """ The count elements compressed by _encode, into out if given.
+        offsets of the chunks save walking their headers. With the
+        checksums of _encode every chunk is verified first; an IOError
+        with errno _CORRUPT is raised if one does not match. filter is
+        the one given to _encode. """
+    corrupt = IOError(_CORRUPT,
+            "compressed data does not match its checksums")
+    name, distance = filter or (None, 1)
+    try:
+        if codec == 'bslz4':
+            return bitshuffle.decompress_lz4(compressed, (count,), dtype,
+                    block_size, out=out, offsets=offsets,
+                    checksums=checksums, filter=name, distance=distance)
+        if codec == 'bszlib':
+            return bitshuffle.decompress_zlib(compressed, (count,), dtype,
+                    block_size, out=out, offsets=offsets,
+                    checksums=checksums, filter=name, distance=distance)
+    except RuntimeError as e:
+        if e.args[-1] == _CORRUPT:
+            raise corrupt
+        raise
+    fixed = _fixed_offsets(count, numpy.dtype(dtype).itemsize, block_size)
+    if offsets is None:
+        offsets = fixed
+    if checksums is not None:
+        if (bitshuffle.crc32c_chunks(compressed, offsets)
+                != checksums).any():
+            raise corrupt
+    if (offsets != fixed).any():
+        # chunks followed by bytes an append left unused
+        compressed = numpy.concatenate([compressed[int(o):int(o + n)]
+            for o, n in zip(offsets[:-1], numpy.diff(fixed))])
+    data = compressed.view(dtype)
+    if codec == 'bitshuffle':
+        data = bitshuffle.bitunshuffle(data, block_size)
+    if out is None:
+        # not a view holding on to the data file
+        return numpy.array(data)
+    out[...] = data
+    return out
+
+def _autotune_block_size(elements, codec, nbytes=1024 * 1024, filter=None):
+    """ The block size, in elements, for compressing elements with
+        codec and filter. Block sizes from an eighth of the L1 cache to half
+        of the L2 cache, where a block and its compressed copy
+        stay in the cache, are tried on the first nbytes of
+        elements; of those decompressing no more than 25% slower
+        than the fastest the one compressing best is picked.
+        Blocks no longer than the distance of filter, as for rows,
+        are not tried: they would not be filtered at all. """
+    elements = numpy.ascontiguousarray(elements).reshape(-1)
+    itemsize = elements.dtype.itemsize
+    default = bitshuffle.default_block_size(itemsize)
+    if codec == 'raw':
+        return default
+    sample = elements[:max(nbytes // itemsize, 1)]
+    distance = filter[1] if filter is not None else 0
+    candidates = []
+    b = _cache_size(1, 32 * 1024) // 8
+    while b <= max(_cache_size(2, 256 * 1024) // 2, 8192):
+        bs = b // itemsize // 8 * 8
+        # a few blocks, for a fair measure
+        if bs >= 8 and bs > distance and bs * 4 <= len(sample) \
+            and bs not in candidates:
+            candidates.append(bs)
+        b *= 2
+    if len(candidates) == 0:
+        return default
+    results = []
+    for bs in candidates:
+        compressed, offsets, checksums = _encode(codec, sample, bs,
+                filter=filter)
+        best = None
+        for i in range(3):
+            t0 = time.time()
+            _decode(codec, compressed, len(sample), sample.dtype, bs,
+                    offsets=offsets, filter=filter)
+            t = time.time() - t0
+            if best is None or t < best:
+                best = t
+        results.append((len(compressed), best, bs))
+    fastest = min(t for n, t, bs in results)
+    return min((n, bs) for n, t, bs in results if t <= 1.25 * fastest)[1]
+
+def _cache_size(level, default):
+    """ Bytes in the data cache of level of the first cpu, as
+        linux tells in sysfs, or default. """
+    path = '/sys/devices/system/cpu/cpu0/cache'
+    units = {'K' : 1024, 'M' : 1024 ** 2, 'G' : 1024 ** 3}
+    try:
+        for index in sorted(os.listdir(path)):
+            if not index.startswith('index'):
+                continue
+            def read(name):
+                with file(os.path.join(path, index, name), 'r') as ff:
+                    return ff.read().strip()
+            if int(read('level')) != level or read('type') == 'Instruction':
+                continue
+            size = read('size')
+            if size[-1] in units:
+                return int(size[:-1]) * units[size[-1]]
+            return int(size)
+    except (OSError, IOError, ValueError):
+        pass
+    return default
+
+def _swappable(dtype, target):
+    """ If the numbers of dtype are those of target byte swapped """
+    return dtype != target and dtype.kind in 'iufc' and dtype.shape == () \
+        and dtype.newbyteorder('S') == target
+
+def _zonemap(elements, block_size):
+    """ min, max and number of NaNs of every block_size elements. """
+    native = elements.dtype.newbyteorder('=')
+    dtype = numpy.dtype([('min', native), ('max', native),
+        ('nnan', 'u8')])
+    zonemap = numpy.empty(-(-len(elements) // block_size), dtype)
+    if len(zonemap) == 0:
+        return zonemap
+    starts = numpy.arange(0, len(elements), block_size)
+    zonemap['min'] = numpy.fmin.reduceat(elements, starts)
+    zonemap['max'] = numpy.fmax.reduceat(elements, starts)
+    if elements.dtype.kind == 'f':
+        zonemap['nnan'] = numpy.add.reduceat(numpy.isnan(elements), starts)
+    else:
+        zonemap['nnan'] = 0
+    return zonemap
+
+def _read_block(tree, blockname):
+    block = tree[blockname]
+    return blockname, block, block[...]
+
+def _remove_manifest(blockpath):
+    """ The manifest of the tree holding the block is out of date """
+    filename = os.path.join(os.path.dirname(os.path.normpath(blockpath)),
+            'manifest.pickle')
+    if os.path.exists(filename):
+        try:
+            os.remove(filename)
+        except OSError:
+            # removed by another writer meanwhile
+            pass
+
+def _replace(filename, write):
+    """ Replace filename by what write(file) writes, by a rename so
+        readers see the old or the new file, never a partial one. """
+    tmpfilename = filename + '.tmp'
+    with file(tmpfilename, 'wb') as ff:
+        write(ff)
+    os.rename(tmpfilename, filename)
+
+def _load_cached(filename, load):
+    """ load(file) of filename through the cache, None if there is
+        no such file. """
+    key = cache.filekey(filename)
+    if key is None:
+        return None
+    value = cache.default.get(key)
+    if value is None:
+        with file(filename, 'r') as ff:
+            value = load(ff)
+        cache.default.put(key, value, key[2])
+    return value
+
+def _match(data, lo, hi):
+    mask = numpy.ones(data.shape, dtype='?')
+    if lo is not None:
+        mask &= data >= lo
+    if hi is not None:
+        mask &= data <= hi
+    return mask
+
+def _rows_per_chunk(block, nbytes=64 * 1024 * 1024):
+    """ Rows of block in about nbytes of memory. """
+    rowbytes = block.dtype.itemsize * int(numpy.prod(block.shape[1:]))
+    return max(1, nbytes // max(rowbytes, 1))
+
+def _isfull(index):
+    return index is Ellipsis or \
+        (isinstance(index, slice) and index == slice(None))
+
+def _expand_index(index, ndim):
+    """ index as a tuple of one index per axis. """
+    if not isinstance(index, tuple):
+        index = (index,)
+    ellipsis = [i for i, ind in enumerate(index) if ind is Ellipsis]
+    if ellipsis:
+        i = ellipsis[0]
+        index = index[:i] + (slice(None),) * (ndim - len(index) + 1) \
+                + index[i + 1:]
+    if len(index) > ndim:
+        raise IndexError("too many indices")
+    return index + (slice(None),) * (ndim - len(index))
+
+def _rowindex(index, nrows):
+    """ Convert an index along the first axis to the range of rows
+        lo to hi it touches, and the index sub into these rows. """
+    if isinstance(index, slice):
+        start, stop, step = index.indices(nrows)
+        if step == 1:
+            return start, max(start, stop), slice(None)
+        index = numpy.arange(start, stop, step)
+    elif isinstance(index, (int, long, numpy.integer)):
+        if index < 0:
+            index += nrows
+        if index < 0 or index >= nrows:
+            raise IndexError("index %d out of bounds" % index)
+        return index, index + 1, 0
+    else:
+        index = numpy.asarray(index)
+        if index.dtype == numpy.bool_:
+            index = index.nonzero()[0]
+        index = numpy.where(index < 0, index + nrows, index)
+    if len(index) == 0:
+        return 0, 0, index
+    lo, hi = index.min(), index.max() + 1
+    if lo < 0 or hi > nrows:
+        raise IndexError("index out of bounds")
+    return lo, hi, index - lo
+
 class FSHR(object):
-    def __init__(self, path):
+    """ A tree of blocks. The blocks have their own files; the manifest,
+        manifest.pickle, has all of them in one file, so opening
+        the tree and its blocks costs a single read. It is written
+        when the tree is flushed after blocks were added, and removed
+        when a block is changed; without it the files of each block
+        are read as the block is opened. """
+    def __init__(self, path, mmap=True, preload=True):
         self.path = path
+        self.mmap = mmap
+        self.preload = preload
         self.blocksfilename = os.path.join(self.path, 'blocks.json')
+        self.manifestfilename = os.path.join(self.path, 'manifest.pickle')
+        self.manifest = None
+        self._dirty = False
          
     @classmethod
-    def open(kls, path):
-        self = kls(path)
-        with file(self.blocksfilename, 'r') as ff:
-            self.blocks = json.load(ff)
+    def open(kls, path, mmap=True, preload=True):
+        """ Open the tree at path. With preload False the manifest
+            is not read, only the names of the blocks; the blocks
+            read their dtype, shape and header as they are asked
+            for, which is cheap when only a few are. """
+        self = kls(path, mmap, preload)
+        if preload and os.path.exists(self.manifestfilename):
+            with file(self.manifestfilename, 'rb') as ff:
+                manifest = pickle.loads(ff.read())
+            self.blocks = manifest['blocks']
+            self.manifest = manifest['entries']
+        else:
+            with file(self.blocksfilename, 'r') as ff:
+                self.blocks = json.load(ff)
         return self
 
     @classmethod
@@ -105,6 +1358,7 @@ class FSHR(object):
         if not os.path.exists(self.path):
             raise IOError("path %s not avalable" % self.path)
 
+        self._dirty = True
         self.flush()
         return self
 
@@ -115,18 +1369,70 @@ class FSHR(object):
         self.flush()
 
     def flush(self):
+        if not self._dirty:
+            return
         with file(self.blocksfilename, 'w') as ff:
             json.dump(self.blocks, ff)
+        self.write_manifest()
+        self._dirty = False
+
+    def write_manifest(self):
+        """ Collect the dtype, shape, metadata and chunk indexes of all
+            blocks into the manifest. """
+        entries = {}
+        for blockname in self.blocks:
+            block = Block.open(os.path.join(self.path, blockname), self.mmap)
+            entries[blockname] = block._manifest_entry()
+        manifest = {'blocks' : self.blocks, 'entries' : entries}
+        tmpfilename = self.manifestfilename + '.tmp'
+        with file(tmpfilename, 'wb') as ff:
+            pickle.dump(manifest, ff, pickle.HIGHEST_PROTOCOL)
+        os.rename(tmpfilename, self.manifestfilename)
+        self.manifest = entries
 
-    def create_block(self, blockname, shape, dtype):
+    def create_block(self, blockname, shape, dtype, layout=None,
+            tiles=None, codec='bslz4', block_size=None, native=False,
+            checksums=False, filter=None):
         assert blockname not in self.blocks
         bb = Block.create(
                 os.path.join(self.path, blockname), 
-                    shape, dtype)
+                    shape, dtype, layout, tiles, codec, block_size, native,
+                    checksums, filter)
         self.blocks.append(blockname)
         self.blocks = sorted(self.blocks)
+        self.manifest = None
+        self._dirty = True
         return bb
 
+    def iter_data(self, prefetch=2):
+        """ Iterate over (blockname, block, block[...]) for all blocks.
+
+            While one is processed by the caller, the following
+            prefetch blocks are read and decompressed by background
+            threads. The decompressor releases the GIL and, with mmap,
+            the pages of the data are faulted in by it, so reading
+            from disk, decompressing and the caller all overlap. """
+        if prefetch <= 0:
+            for blockname in self.blocks:
+                block = self[blockname]
+                yield blockname, block, block[...]
+            return
+        pool = ThreadPool(prefetch)
+        try:
+            blocknames = iter(self.blocks)
+            pending = collections.deque()
+            for blockname in itertools.islice(blocknames, prefetch):
+                pending.append(pool.apply_async(_read_block,
+                    (self, blockname)))
+            while pending:
+                result = pending.popleft()
+                for blockname in itertools.islice(blocknames, 1):
+                    pending.append(pool.apply_async(_read_block,
+                        (self, blockname)))
+                yield result.get()
+        finally:
+            pool.terminate()
+
     def __iter__(self):
         return iter(self.blocks)
     def __contains__(self, key):
@@ -134,4 +1440,8 @@ class FSHR(object):
 
     def __getitem__(self, blockname):
         assert blockname in self.blocks
-        return Block.open(os.path.join(self.path, blockname))
+        entry = None
+        if self.manifest is not None:
+            entry = self.manifest.get(blockname)
+        return Block.open(os.path.join(self.path, blockname), self.mmap,
+                entry, self.preload)
@@ -6,12 +6,31 @@ Functions
 
     using_SSE2
     using_AVX2
+    using_AVX512
+    using_NEON
+    select_isa
+    set_num_threads
+    stats_enable
+    stats
+    stats_reset
     bitshuffle
     bitunshuffle
     compress_lz4
+    compress_lz4_bound
     decompress_lz4
+    compress_zlib
+    compress_zlib_bound
+    decompress_zlib
+    default_block_size
+    lz4_chunk_offsets
+    crc32c
+    crc32c_chunks
 
 """
 
 from ext import (__version__, bitshuffle, bitunshuffle, using_SSE2, using_AVX2,
-                 compress_lz4, decompress_lz4)
+                 using_AVX512, using_NEON, select_isa, set_num_threads,
+                 stats_enable, stats, stats_reset,
+                 compress_lz4, compress_lz4_bound, decompress_lz4, compress_zlib,
+                 compress_zlib_bound, decompress_zlib, default_block_size,
+                 lz4_chunk_offsets, crc32c, crc32c_chunks)
@@ -10,34 +10,89 @@
  */
 
 #include "bitshuffle.h"
-#include "iochain.h"
 #include "lz4.h"
+#include <zlib.h>
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
+// With GCC and Clang on x86 every instruction set variant of the kernels is
+// compiled, each with its own target attribute, and the best one the CPU
+// supports is selected at runtime. Define BSHUF_NO_DISPATCH to only use the
+// instruction sets enabled at compile time instead.
+#if !defined(BSHUF_NO_DISPATCH) && defined(__GNUC__) \
+        && (defined(__x86_64__) || defined(__i386__))
+#define BSHUF_DISPATCH
+#endif
 
-#if defined(__AVX2__) && defined (__SSE2__)
+#if (defined(__AVX2__) && defined (__SSE2__)) || defined(BSHUF_DISPATCH)
 #define USEAVX2
 #endif
 
-#if defined(__SSE2__)
+#if defined(__SSE2__) || defined(BSHUF_DISPATCH)
 #define USESSE2
 #endif
 
+#if (defined(__AVX512BW__) && defined(__AVX512F__)) || defined(BSHUF_DISPATCH)
+#define USEAVX512
+#endif
+
+// NEON is part of the base ARMv8-A instruction set, no dispatch needed.
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define USENEON
+#endif
 
-// Conditional includes for SSE2 and AVX2.
-#ifdef USEAVX2
+// The crc32 instructions for CRC32C: SSE4.2, or the optional CRC extension of
+// ARMv8-A, which has to be enabled at compile time (-march=armv8-a+crc).
+#if defined(__SSE4_2__) || defined(BSHUF_DISPATCH)
+#define USESSE42
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define USEARMCRC
+#endif
+
+#ifdef BSHUF_DISPATCH
+#define BSHUF_TARGET_SSE2 __attribute__((target("sse2")))
+#define BSHUF_TARGET_AVX2 __attribute__((target("avx2")))
+#define BSHUF_TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#define BSHUF_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define BSHUF_TARGET_SSE2
+#define BSHUF_TARGET_AVX2
+#define BSHUF_TARGET_AVX512
+#define BSHUF_TARGET_SSE42
+#endif
+
+
+// Conditional includes for SSE2, AVX2 and AVX-512, and NEON.
+#if defined USEAVX2 || defined USEAVX512
 #include <immintrin.h>
 #elif defined USESSE2
 #include <emmintrin.h>
 #endif
+#ifdef USENEON
+#include <arm_neon.h>
+#endif
+#ifdef USESSE42
+#include <nmmintrin.h>
+#endif
+#ifdef USEARMCRC
+#include <arm_acle.h>
+#endif
 
 
 // Constants.
 #define BSHUF_MIN_RECOMMEND_BLOCK 128
 #define BSHUF_BLOCKED_MULT 8    // Block sizes must be multiple of this.
 #define BSHUF_TARGET_BLOCK_SIZE_B 8192
+// Largest block the compressors take: the LZ4 limit, also in the 4 byte header.
+#define BSHUF_MAX_BLOCK_BYTES LZ4_MAX_INPUT_SIZE
 // Use fast decompression instead of safe decompression for LZ4.
 #define BSHUF_LZ4_DECOMPRESS_FAST
 
@@ -50,25 +105,53 @@
 #define CHECK_ERR_FREE(count, buf) if (count < 0) { free(buf); return count; }
 #define CHECK_ERR_FREE_LZ(count, buf) if (count < 0) {                      \
     free(buf); return count - 1000; }
+#define CHECK_ERR_LZ(count) if (count < 0) { return count - 1000; }
+
+
+/* ---- Functions indicating the selected instruction set. ---- */
 
+/* Bitshuffle kernels in use, see *bshuf_select_isa*. */
+typedef int64_t (*bshufTransFunDef)(void* in, void* out, const size_t size,
+        const size_t elem_size);
+
+int bshuf_isa = -1;
+bshufTransFunDef bshuf_trans_bit_elem_sel = NULL;
+bshufTransFunDef bshuf_untrans_bit_elem_sel = NULL;
+// The passes of *bshuf_trans_bit_elem_sel* and *bshuf_untrans_bit_elem_sel*,
+// for *bshuf_trans_bit_elem_swap* and *bshuf_kernels_select*.
+bshufTransFunDef bshuf_trans_byte_elem_sel = NULL;
+bshufTransFunDef bshuf_trans_bit_byte_sel = NULL;
+bshufTransFunDef bshuf_trans_byte_bitrow_sel = NULL;
+bshufTransFunDef bshuf_shuffle_bit_eightelem_sel = NULL;
+
+/* CRC32C routine in use, also chosen by *bshuf_select_isa*. */
+typedef uint32_t (*bshufCRCFunDef)(uint32_t crc, const void* buf,
+        const size_t nbytes);
+
+bshufCRCFunDef bshuf_crc32c_sel = NULL;
 
-/* ---- Functions indicating compile time instruction set. ---- */
 
 int bshuf_using_SSE2(void) {
-#ifdef USESSE2
-    return 1;
-#else
-    return 0;
-#endif
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_isa >= BSHUF_ISA_SSE2 && bshuf_isa <= BSHUF_ISA_AVX512;
 }
 
 
 int bshuf_using_AVX2(void) {
-#ifdef USEAVX2
-    return 1;
-#else
-    return 0;
-#endif
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_isa >= BSHUF_ISA_AVX2 && bshuf_isa <= BSHUF_ISA_AVX512;
+}
+
+
+int bshuf_using_AVX512(void) {
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_isa == BSHUF_ISA_AVX512;
+}
+
+
+int bshuf_using_NEON(void) {
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_isa == BSHUF_ISA_NEON;
 }
 
 
@@ -123,9 +206,10 @@ int64_t bshuf_copy(void* in, void* out, const size_t size,
 }
 
 
-/* Transpose bytes within elements, starting partway through input. */
-int64_t bshuf_trans_byte_elem_remainder(void* in, void* out, const size_t size,
-         const size_t elem_size, const size_t start) {
+/* Transpose bytes within elements, starting partway through input. Inlined
+ * with a constant *elem_size* by the specialized kernels. */
+static inline int64_t bshuf_trans_byte_elem_loop(void* in, void* out,
+        const size_t size, const size_t elem_size, const size_t start) {
 
     char* in_b = (char*) in;
     char* out_b = (char*) out;
@@ -153,6 +237,14 @@ int64_t bshuf_trans_byte_elem_remainder(void* in, void* out, const size_t size,
 }
 
 
+/* Transpose bytes within elements, starting partway through input. */
+int64_t bshuf_trans_byte_elem_remainder(void* in, void* out, const size_t size,
+         const size_t elem_size, const size_t start) {
+
+    return bshuf_trans_byte_elem_loop(in, out, size, elem_size, start);
+}
+
+
 /* Transpose bytes within elements. */
 int64_t bshuf_trans_byte_elem_scal(void* in, void* out, const size_t size,
          const size_t elem_size) {
@@ -224,6 +316,55 @@ int64_t bshuf_trans_bitrow_eight(void* in, void* out, const size_t size,
 }
 
 
+/* Reverse the bytes within elements in groups of *swap_size*; the routines
+ * taking a *swap_size* produce from *in* what they would from this. */
+int64_t bshuf_copy_swap(void* in, void* out, const size_t size,
+         const size_t elem_size, const size_t swap_size) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    size_t nbyte = size * elem_size;
+
+    if (swap_size <= 1) return bshuf_copy(in, out, size, elem_size);
+    if (elem_size % swap_size) return -82;
+
+    for (size_t ii = 0; ii < nbyte; ii += swap_size) {
+        for (size_t jj = 0; jj < swap_size; jj ++) {
+            out_b[ii + jj] = in_b[ii + swap_size - 1 - jj];
+        }
+    }
+    return nbyte;
+}
+
+
+/* Transpose rows of shuffled bits like *bshuf_trans_bitrow_eight*, reversing
+ * the bytes within elements in groups of *swap_size* on the way. Byte *jj* of
+ * every element has its own row of bits in *in*, so the reversal only changes
+ * which rows are copied where and costs nothing. */
+int64_t bshuf_trans_bitrow_eight_swap(void* in, void* out, const size_t size,
+         const size_t elem_size, const size_t swap_size) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    size_t nbyte_bitrow = size / 8;
+
+    CHECK_MULT_EIGHT(size);
+    if (swap_size <= 1) {
+        return bshuf_trans_bitrow_eight(in, out, size, elem_size);
+    }
+    if (elem_size % swap_size) return -82;
+
+    for (size_t ii = 0; ii < 8; ii ++) {
+        for (size_t jj = 0; jj < elem_size; jj ++) {
+            size_t kk = jj - jj % swap_size + swap_size - 1 - jj % swap_size;
+            memcpy(&out_b[(jj * 8 + ii) * nbyte_bitrow],
+                   &in_b[(ii * elem_size + kk) * nbyte_bitrow], nbyte_bitrow);
+        }
+    }
+    return size * elem_size;
+}
+
+
 /* Transpose bits within elements. */
 int64_t bshuf_trans_bit_elem_scal(void* in, void* out, const size_t size,
          const size_t elem_size) {
@@ -248,9 +389,9 @@ int64_t bshuf_trans_bit_elem_scal(void* in, void* out, const size_t size,
 
 
 /* For data organized into a row for each bit (8 * elem_size rows), transpose
- * the bytes. */
-int64_t bshuf_trans_byte_bitrow_scal(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+ * the bytes. Inlined with a constant *elem_size* by the specialized kernels. */
+static inline int64_t bshuf_trans_byte_bitrow_loop(void* in, void* out,
+        const size_t size, const size_t elem_size) {
     char* in_b = (char*) in;
     char* out_b = (char*) out;
 
@@ -270,8 +411,18 @@ int64_t bshuf_trans_byte_bitrow_scal(void* in, void* out, const size_t size,
 }
 
 
-/* Shuffle bits within the bytes of eight element blocks. */
-int64_t bshuf_shuffle_bit_eightelem_scal(void* in, void* out,
+/* For data organized into a row for each bit (8 * elem_size rows), transpose
+ * the bytes. */
+int64_t bshuf_trans_byte_bitrow_scal(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+
+    return bshuf_trans_byte_bitrow_loop(in, out, size, elem_size);
+}
+
+
+/* Shuffle bits within the bytes of eight element blocks. Inlined with a
+ * constant *elem_size* by the specialized kernels. */
+static inline int64_t bshuf_shuffle_bit_eightelem_loop(void* in, void* out,
         const size_t size, const size_t elem_size) {
 
     CHECK_MULT_EIGHT(size);
@@ -297,6 +448,14 @@ int64_t bshuf_shuffle_bit_eightelem_scal(void* in, void* out,
 }
 
 
+/* Shuffle bits within the bytes of eight element blocks. */
+int64_t bshuf_shuffle_bit_eightelem_scal(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    return bshuf_shuffle_bit_eightelem_loop(in, out, size, elem_size);
+}
+
+
 /* Untranspose bits within elements. */
 int64_t bshuf_untrans_bit_elem_scal(void* in, void* out, const size_t size,
          const size_t elem_size) {
@@ -318,6 +477,145 @@ int64_t bshuf_untrans_bit_elem_scal(void* in, void* out, const size_t size,
 }
 
 
+/* ---- Kernels specialized for element sizes ----
+ *
+ * The loops above with *elem_size* a compile time constant, which the
+ * compiler unrolls, for the sizes of numbers. Records of an odd size, such
+ * as the rows of a catalog, have their bytes transposed eight bytes of eight
+ * elements at a time in 64 bit registers. *bshuf_kernels_select* picks the
+ * kernels once per routine, not per block.
+ *
+ */
+
+/* Transpose the 8x8 bytes of *r*: byte *ii* of r[jj] becomes byte *jj* of
+ * r[ii]. Swaps the off diagonal halves of 2x2 blocks of bytes, then of 16 and
+ * of 32 bits. */
+static inline void bshuf_trans_byte_8x8(uint64_t* r) {
+
+    uint64_t t;
+
+    for (int ii = 0; ii < 8; ii += 2) {
+        t = ((r[ii] >> 8) ^ r[ii + 1]) & 0x00FF00FF00FF00FFULL;
+        r[ii + 1] ^= t;
+        r[ii] ^= t << 8;
+    }
+    for (int ii = 0; ii < 8; ii += 4) {
+        for (int jj = ii; jj < ii + 2; jj ++) {
+            t = ((r[jj] >> 16) ^ r[jj + 2]) & 0x0000FFFF0000FFFFULL;
+            r[jj + 2] ^= t;
+            r[jj] ^= t << 16;
+        }
+    }
+    for (int jj = 0; jj < 4; jj ++) {
+        t = ((r[jj] >> 32) ^ r[jj + 4]) & 0x00000000FFFFFFFFULL;
+        r[jj + 4] ^= t;
+        r[jj] ^= t << 32;
+    }
+}
+
+
+/* Transpose bytes within elements of a few bytes, an element at a time, which
+ * the compiler vectorizes for a constant *elem_size*. */
+static inline int64_t bshuf_trans_byte_elem_narrow_loop(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+
+    for (size_t ii = 0; ii < size; ii ++) {
+        for (size_t jj = 0; jj < elem_size; jj ++) {
+            out_b[jj * size + ii] = in_b[ii * elem_size + jj];
+        }
+    }
+    return size * elem_size;
+}
+
+
+/* Transpose bytes within elements of at least 8 bytes, a quadword of each of
+ * eight elements at a time; the elem_size % 8 bytes left of each by the byte
+ * loop. */
+static inline int64_t bshuf_trans_byte_elem_wide_loop(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    size_t nbyte_wide = elem_size - elem_size % 8;
+    uint64_t r[8];
+
+    for (size_t ii = 0; ii + 7 < size; ii += 8) {
+        for (size_t jj = 0; jj < nbyte_wide; jj += 8) {
+            for (size_t kk = 0; kk < 8; kk ++) {
+                memcpy(&r[kk], &in_b[(ii + kk) * elem_size + jj], 8);
+            }
+            bshuf_trans_byte_8x8(r);
+            for (size_t kk = 0; kk < 8; kk ++) {
+                memcpy(&out_b[(jj + kk) * size + ii], &r[kk], 8);
+            }
+        }
+        for (size_t jj = nbyte_wide; jj < elem_size; jj ++) {
+            for (size_t kk = 0; kk < 8; kk ++) {
+                out_b[jj * size + ii + kk]
+                    = in_b[ii * elem_size + kk * elem_size + jj];
+            }
+        }
+    }
+    for (size_t ii = size - size % 8; ii < size; ii ++) {
+        for (size_t jj = 0; jj < elem_size; jj ++) {
+            out_b[jj * size + ii] = in_b[ii * elem_size + jj];
+        }
+    }
+    return size * elem_size;
+}
+
+
+/* Transpose bytes within elements of at least 8 bytes. */
+int64_t bshuf_trans_byte_elem_wide(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+
+    return bshuf_trans_byte_elem_wide_loop(in, out, size, elem_size);
+}
+
+
+/* Transpose bytes within elements of 2 bytes. */
+static int64_t bshuf_trans_byte_elem_scal_2(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+    return bshuf_trans_byte_elem_narrow_loop(in, out, size, 2);
+}
+
+
+/* Transpose bytes within elements of 8 bytes. */
+static int64_t bshuf_trans_byte_elem_scal_8(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+    return bshuf_trans_byte_elem_wide_loop(in, out, size, 8);
+}
+
+
+/* Transpose bytes within elements of 16 bytes. */
+static int64_t bshuf_trans_byte_elem_scal_16(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+    return bshuf_trans_byte_elem_wide_loop(in, out, size, 16);
+}
+
+
+// The scalar kernels of the bit transpose for elements of N bytes.
+#define BSHUF_SCAL_KERNELS(N)                                               \
+static int64_t bshuf_trans_byte_bitrow_scal_##N(void* in, void* out,        \
+        const size_t size, const size_t elem_size) {                        \
+    return bshuf_trans_byte_bitrow_loop(in, out, size, N);                  \
+}                                                                           \
+                                                                            \
+static int64_t bshuf_shuffle_bit_eightelem_scal_##N(void* in, void* out,    \
+        const size_t size, const size_t elem_size) {                        \
+    return bshuf_shuffle_bit_eightelem_loop(in, out, size, N);              \
+}
+
+BSHUF_SCAL_KERNELS(1)
+BSHUF_SCAL_KERNELS(2)
+BSHUF_SCAL_KERNELS(4)
+BSHUF_SCAL_KERNELS(8)
+BSHUF_SCAL_KERNELS(16)
+
+
 /* ---- Worker code that uses SSE2 ----
  *
  * The following code makes use of the SSE2 instruction set and specialized
@@ -330,6 +628,7 @@ int64_t bshuf_untrans_bit_elem_scal(void* in, void* out, const size_t size,
 #ifdef USESSE2
 
 /* Transpose bytes within elements for 16 bit elements. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_byte_elem_SSE_16(void* in, void* out, const size_t size) {
 
     char* in_b = (char*) in;
@@ -361,6 +660,7 @@ int64_t bshuf_trans_byte_elem_SSE_16(void* in, void* out, const size_t size) {
 
 
 /* Transpose bytes within elements for 32 bit elements. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_byte_elem_SSE_32(void* in, void* out, const size_t size) {
 
     char* in_b = (char*) in;
@@ -404,6 +704,7 @@ int64_t bshuf_trans_byte_elem_SSE_32(void* in, void* out, const size_t size) {
 
 
 /* Transpose bytes within elements for 64 bit elements. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_byte_elem_SSE_64(void* in, void* out, const size_t size) {
 
     char* in_b = (char*) in;
@@ -472,6 +773,7 @@ int64_t bshuf_trans_byte_elem_SSE_64(void* in, void* out, const size_t size) {
 
 
 /* Transpose bytes within elements using best SSE algorithm available. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_byte_elem_SSE(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -534,6 +836,7 @@ int64_t bshuf_trans_byte_elem_SSE(void* in, void* out, const size_t size,
 
 
 /* Transpose bits within bytes. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_bit_byte_SSE(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -566,6 +869,7 @@ int64_t bshuf_trans_bit_byte_SSE(void* in, void* out, const size_t size,
 
 
 /* Transpose bits within elements. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_bit_elem_SSE(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -590,6 +894,7 @@ int64_t bshuf_trans_bit_elem_SSE(void* in, void* out, const size_t size,
 
 /* For data organized into a row for each bit (8 * elem_size rows), transpose
  * the bytes. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_trans_byte_bitrow_SSE(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -695,6 +1000,7 @@ int64_t bshuf_trans_byte_bitrow_SSE(void* in, void* out, const size_t size,
 
 
 /* Shuffle bits within the bytes of eight element blocks. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_shuffle_bit_eightelem_SSE(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -731,6 +1037,7 @@ int64_t bshuf_shuffle_bit_eightelem_SSE(void* in, void* out, const size_t size,
 
 
 /* Untranspose bits within elements. */
+BSHUF_TARGET_SSE2
 int64_t bshuf_untrans_bit_elem_SSE(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -821,6 +1128,7 @@ int64_t bshuf_shuffle_bit_eightelem_SSE(void* in, void* out, const size_t size,
 #ifdef USEAVX2
 
 /* Transpose bits within bytes. */
+BSHUF_TARGET_AVX2
 int64_t bshuf_trans_bit_byte_AVX(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -851,6 +1159,7 @@ int64_t bshuf_trans_bit_byte_AVX(void* in, void* out, const size_t size,
 
 
 /* Transpose bits within elements. */
+BSHUF_TARGET_AVX2
 int64_t bshuf_trans_bit_elem_AVX(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -875,6 +1184,7 @@ int64_t bshuf_trans_bit_elem_AVX(void* in, void* out, const size_t size,
 
 /* For data organized into a row for each bit (8 * elem_size rows), transpose
  * the bytes. */
+BSHUF_TARGET_AVX2
 int64_t bshuf_trans_byte_bitrow_AVX(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -969,6 +1279,7 @@ int64_t bshuf_trans_byte_bitrow_AVX(void* in, void* out, const size_t size,
 
 
 /* Shuffle bits within the bytes of eight element blocks. */
+BSHUF_TARGET_AVX2
 int64_t bshuf_shuffle_bit_eightelem_AVX(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -1005,6 +1316,7 @@ int64_t bshuf_shuffle_bit_eightelem_AVX(void* in, void* out, const size_t size,
 
 
 /* Untranspose bits within elements. */
+BSHUF_TARGET_AVX2
 int64_t bshuf_untrans_bit_elem_AVX(void* in, void* out, const size_t size,
          const size_t elem_size) {
 
@@ -1058,130 +1370,1860 @@ int64_t bshuf_untrans_bit_elem_AVX(void* in, void* out, const size_t size,
 #endif // #ifdef USEAVX2
 
 
-/* ---- Drivers selecting best instruction set at compile time. ---- */
+/* ---- Code that requires AVX-512. Intel Skylake-SP (2017) and later. ---- */
 
-int64_t bshuf_trans_bit_elem(void* in, void* out, const size_t size, 
-        const size_t elem_size) {
+/* ---- Worker code that uses AVX-512 ----
+ *
+ * The following code makes use of the AVX-512BW instruction set and its 64
+ * byte registers. Only the bit transposes benefit: *_mm512_movepi8_mask*
+ * gathers the top bit of 64 bytes at once. The byte transposes are left to
+ * the AVX2 code.
+ *
+ */
 
-    int64_t count;
-#ifdef USEAVX2
-    count = bshuf_trans_bit_elem_AVX(in, out, size, elem_size);
-#elif defined(USESSE2)
-    count = bshuf_trans_bit_elem_SSE(in, out, size, elem_size);
-#else
-    count = bshuf_trans_bit_elem_scal(in, out, size, elem_size);
-#endif
-    return count;
-}
+#ifdef USEAVX512
 
+/* Transpose bits within bytes. */
+BSHUF_TARGET_AVX512
+int64_t bshuf_trans_bit_byte_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
 
-int64_t bshuf_untrans_bit_elem(void* in, void* out, const size_t size, 
-        const size_t elem_size) {
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    uint64_t* out_ui64;
+
+    size_t nbyte = elem_size * size;
 
     int64_t count;
-#ifdef USEAVX2
-    count = bshuf_untrans_bit_elem_AVX(in, out, size, elem_size);
-#elif defined(USESSE2)
-    count = bshuf_untrans_bit_elem_SSE(in, out, size, elem_size);
-#else
-    count = bshuf_untrans_bit_elem_scal(in, out, size, elem_size);
-#endif
+
+    CHECK_MULT_EIGHT(nbyte);
+
+    __m512i zmm;
+    uint64_t bt;
+
+    for (size_t ii = 0; ii + 63 < nbyte; ii += 64) {
+        zmm = _mm512_loadu_si512((void *) &in_b[ii]);
+        for (size_t kk = 0; kk < 8; kk++) {
+            bt = _mm512_movepi8_mask(zmm);
+            zmm = _mm512_slli_epi16(zmm, 1);
+            out_ui64 = (uint64_t*) &out_b[((7 - kk) * nbyte + ii) / 8];
+            *out_ui64 = bt;
+        }
+    }
+    count = bshuf_trans_bit_byte_remainder(in, out, size, elem_size,
+            nbyte - nbyte % 64);
     return count;
 }
 
 
-/* ---- Wrappers for implementing blocking ---- */
+/* Transpose bits within elements. */
+BSHUF_TARGET_AVX512
+int64_t bshuf_trans_bit_elem_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
 
-/* Function definition for worker functions that process a single block. */
-typedef int64_t (*bshufBlockFunDef)(ioc_chain* C_ptr,
-        const size_t size, const size_t elem_size);
+    int64_t count;
 
+    CHECK_MULT_EIGHT(size);
 
-/* Wrap a function for processing a single block to process an entire buffer in
- * parallel. */
-int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
-        const size_t size, const size_t elem_size, size_t block_size) {
+    void* tmp_buf = malloc(size * elem_size);
+    if (tmp_buf == NULL) return -1;
 
-    ioc_chain C;
-    ioc_init(&C, in, out);
+    count = bshuf_trans_byte_elem_SSE(in, out, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count = bshuf_trans_bit_byte_AVX512(out, tmp_buf, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count = bshuf_trans_bitrow_eight(tmp_buf, out, size, elem_size);
 
-    int64_t err = 0, count, cum_count = 0;
-    size_t last_block_size;
+    free(tmp_buf);
 
-    if (block_size == 0) {
-        block_size = bshuf_default_block_size(elem_size);
-    }
-    if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+    return count;
+}
 
-    #pragma omp parallel for private(count) reduction(+ : cum_count)
-    for (size_t ii = 0; ii < size / block_size; ii ++) {
-        count = fun(&C, block_size, elem_size);
-        if (count < 0) err = count;
-        cum_count += count;
-    }
 
-    last_block_size = size % block_size;
-    last_block_size = last_block_size - last_block_size % BSHUF_BLOCKED_MULT;
-    if (last_block_size) {
-        count = fun(&C, last_block_size, elem_size);
-        if (count < 0) err = count;
-        cum_count += count;
-    }
+/* Shuffle bits within the bytes of eight element blocks. */
+BSHUF_TARGET_AVX512
+int64_t bshuf_shuffle_bit_eightelem_AVX512(void* in, void* out,
+        const size_t size, const size_t elem_size) {
 
-    if (err < 0) return err;
+    CHECK_MULT_EIGHT(size);
 
-    size_t leftover_bytes = size % BSHUF_BLOCKED_MULT * elem_size;
-    size_t this_iter;
-    char *last_in = (char *) ioc_get_in(&C, &this_iter);
-    ioc_set_next_in(&C, &this_iter, (void *) (last_in + leftover_bytes));
-    char *last_out = (char *) ioc_get_out(&C, &this_iter);
-    ioc_set_next_out(&C, &this_iter, (void *) (last_out + leftover_bytes));
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
 
-    memcpy(last_out, last_in, leftover_bytes);
+    size_t nbyte = elem_size * size;
 
-    ioc_destroy(&C);
+    __m512i zmm;
+    uint64_t bt;
 
-    return cum_count + leftover_bytes;
+    if (elem_size % 8) {
+        return bshuf_shuffle_bit_eightelem_AVX(in, out, size, elem_size);
+    } else {
+        for (size_t jj = 0; jj + 63 < 8 * elem_size; jj += 64) {
+            for (size_t ii = 0; ii + 8 * elem_size - 1 < nbyte;
+                    ii += 8 * elem_size) {
+                zmm = _mm512_loadu_si512((void *) &in_b[ii + jj]);
+                for (size_t kk = 0; kk < 8; kk++) {
+                    bt = _mm512_movepi8_mask(zmm);
+                    zmm = _mm512_slli_epi16(zmm, 1);
+                    size_t ind = (ii + jj / 8 + (7 - kk) * elem_size);
+                    * (uint64_t *) &out_b[ind] = bt;
+                }
+            }
+        }
+    }
+    return size * elem_size;
 }
 
 
-/* Bitshuffle a single block. */
-int64_t bshuf_bitshuffle_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
-
-    size_t this_iter;
-    void *in = ioc_get_in(C_ptr, &this_iter);
-    ioc_set_next_in(C_ptr, &this_iter,
-            (void*) ((char*) in + size * elem_size));
-    void *out = ioc_get_out(C_ptr, &this_iter);
-    ioc_set_next_out(C_ptr, &this_iter,
-            (void *) ((char *) out + size * elem_size));
-
-    int64_t count = bshuf_trans_bit_elem(in, out, size, elem_size);
-    return count;
-}
+/* Untranspose bits within elements. */
+BSHUF_TARGET_AVX512
+int64_t bshuf_untrans_bit_elem_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
 
+    int64_t count;
 
-/* Bitunshuffle a single block. */
-int64_t bshuf_bitunshuffle_block(ioc_chain* C_ptr,
-        const size_t size, const size_t elem_size) {
+    CHECK_MULT_EIGHT(size);
 
+    void* tmp_buf = malloc(size * elem_size);
+    if (tmp_buf == NULL) return -1;
 
-    size_t this_iter;
-    void *in = ioc_get_in(C_ptr, &this_iter);
-    ioc_set_next_in(C_ptr, &this_iter,
-            (void*) ((char*) in + size * elem_size));
-    void *out = ioc_get_out(C_ptr, &this_iter);
-    ioc_set_next_out(C_ptr, &this_iter,
-            (void *) ((char *) out + size * elem_size));
+    count = bshuf_trans_byte_bitrow_AVX(in, tmp_buf, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count =  bshuf_shuffle_bit_eightelem_AVX512(tmp_buf, out, size, elem_size);
 
-    int64_t count = bshuf_untrans_bit_elem(in, out, size, elem_size);
+    free(tmp_buf);
     return count;
 }
 
 
-/* Write a 64 bit unsigned integer to a buffer in big endian order. */
-void bshuf_write_uint64_BE(void* buf, uint64_t num) {
+#else // #ifdef USEAVX512
+
+int64_t bshuf_trans_bit_byte_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+    return -13;
+}
+
+
+int64_t bshuf_trans_bit_elem_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+    return -13;
+}
+
+
+int64_t bshuf_shuffle_bit_eightelem_AVX512(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+    return -13;
+}
+
+
+int64_t bshuf_untrans_bit_elem_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+    return -13;
+}
+
+#endif // #ifdef USEAVX512
+
+
+/* ---- Code that requires NEON. ARMv8-A (AArch64) processors. ---- */
+
+/* ---- Worker code that uses NEON ----
+ *
+ * The following code makes use of the NEON instruction set of 64 bit ARM
+ * processors (Graviton, A64FX, Apple M1). NEON has no equivalent of
+ * *_mm_movemask_epi8*, it is emulated by weighting the top bit of each byte
+ * and adding the bytes horizontally. The byte transposes are left to the
+ * scalar code.
+ *
+ */
+
+#ifdef USENEON
+
+/* Gather the top bit of each of the 16 bytes of *v*. */
+static inline uint16_t bshuf_movemask_NEON(const uint8x16_t v) {
+
+    const int8_t shift_b[16] = {0, 1, 2, 3, 4, 5, 6, 7,
+                                0, 1, 2, 3, 4, 5, 6, 7};
+
+    uint8x16_t bits = vshlq_u8(vshrq_n_u8(v, 7), vld1q_s8(shift_b));
+    return vaddv_u8(vget_low_u8(bits))
+            | (uint16_t) vaddv_u8(vget_high_u8(bits)) << 8;
+}
+
+
+/* Transpose bits within bytes. */
+int64_t bshuf_trans_bit_byte_NEON(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+
+    uint8_t* in_b = (uint8_t*) in;
+    char* out_b = (char*) out;
+    uint16_t* out_ui16;
+
+    int64_t count;
+
+    size_t nbyte = elem_size * size;
+
+    CHECK_MULT_EIGHT(nbyte);
+
+    uint8x16_t xmm;
+
+    for (size_t ii = 0; ii + 15 < nbyte; ii += 16) {
+        xmm = vld1q_u8(&in_b[ii]);
+        for (size_t kk = 0; kk < 8; kk++) {
+            out_ui16 = (uint16_t*) &out_b[((7 - kk) * nbyte + ii) / 8];
+            *out_ui16 = bshuf_movemask_NEON(xmm);
+            xmm = vshlq_n_u8(xmm, 1);
+        }
+    }
+    count = bshuf_trans_bit_byte_remainder(in, out, size, elem_size,
+            nbyte - nbyte % 16);
+    return count;
+}
+
+
+/* Transpose bits within elements. */
+int64_t bshuf_trans_bit_elem_NEON(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+
+    int64_t count;
+
+    CHECK_MULT_EIGHT(size);
+
+    void* tmp_buf = malloc(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+
+    count = bshuf_trans_byte_elem_scal(in, out, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count = bshuf_trans_bit_byte_NEON(out, tmp_buf, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count = bshuf_trans_bitrow_eight(tmp_buf, out, size, elem_size);
+
+    free(tmp_buf);
+
+    return count;
+}
+
+
+/* Shuffle bits within the bytes of eight element blocks. */
+int64_t bshuf_shuffle_bit_eightelem_NEON(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    CHECK_MULT_EIGHT(size);
+
+    uint8_t* in_b = (uint8_t*) in;
+    uint16_t* out_ui16 = (uint16_t*) out;
+
+    size_t nbyte = elem_size * size;
+
+    uint8x16_t xmm;
+
+    if (elem_size % 2) {
+        bshuf_shuffle_bit_eightelem_scal(in, out, size, elem_size);
+    } else {
+        for (size_t ii = 0; ii + 8 * elem_size - 1 < nbyte;
+                ii += 8 * elem_size) {
+            for (size_t jj = 0; jj + 15 < 8 * elem_size; jj += 16) {
+                xmm = vld1q_u8(&in_b[ii + jj]);
+                for (size_t kk = 0; kk < 8; kk++) {
+                    size_t ind = (ii + jj / 8 + (7 - kk) * elem_size);
+                    out_ui16[ind / 2] = bshuf_movemask_NEON(xmm);
+                    xmm = vshlq_n_u8(xmm, 1);
+                }
+            }
+        }
+    }
+    return size * elem_size;
+}
+
+
+/* Untranspose bits within elements. */
+int64_t bshuf_untrans_bit_elem_NEON(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+
+    int64_t count;
+
+    CHECK_MULT_EIGHT(size);
+
+    void* tmp_buf = malloc(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+
+    count = bshuf_trans_byte_bitrow_scal(in, tmp_buf, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count =  bshuf_shuffle_bit_eightelem_NEON(tmp_buf, out, size, elem_size);
+
+    free(tmp_buf);
+
+    return count;
+}
+
+
+#else // #ifdef USENEON
+
+int64_t bshuf_trans_bit_byte_NEON(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+    return -14;
+}
+
+
+int64_t bshuf_trans_bit_elem_NEON(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+    return -14;
+}
+
+
+int64_t bshuf_shuffle_bit_eightelem_NEON(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+    return -14;
+}
+
+
+int64_t bshuf_untrans_bit_elem_NEON(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+    return -14;
+}
+
+#endif // #ifdef USENEON
+
+
+/* ---- CRC32C ----
+ *
+ * The Castagnoli CRC of the checksums of compressed blocks, with the bits
+ * reflected, as computed by the crc32 instructions of SSE4.2 and ARMv8.
+ * Chained like zlib's crc32: pass the result for *buf* to continue with the
+ * bytes following it, 0 to start.
+ */
+
+#define BSHUF_CRC32C_POLY 0x82f63b78
+
+// Tables for eight bytes at once: the CRC of byte ii followed by kk zeros.
+uint32_t bshuf_crc32c_table[8][256];
+
+
+void bshuf_crc32c_init_table(void) {
+    for (int ii = 0; ii < 256; ii ++) {
+        uint32_t crc = ii;
+        for (int jj = 0; jj < 8; jj ++) {
+            crc = crc & 1 ? (crc >> 1) ^ BSHUF_CRC32C_POLY : crc >> 1;
+        }
+        bshuf_crc32c_table[0][ii] = crc;
+    }
+    for (int ii = 0; ii < 256; ii ++) {
+        for (int kk = 1; kk < 8; kk ++) {
+            uint32_t prev = bshuf_crc32c_table[kk - 1][ii];
+            bshuf_crc32c_table[kk][ii] = (prev >> 8)
+                    ^ bshuf_crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+
+uint32_t bshuf_crc32c_scal(uint32_t crc, const void* buf,
+        const size_t nbytes) {
+
+    const uint8_t* b = (const uint8_t*) buf;
+    const uint32_t (*T)[256] = (const uint32_t (*)[256]) bshuf_crc32c_table;
+    size_t ii = 0;
+
+    crc = ~crc;
+    for (; ii + 8 <= nbytes; ii += 8) {
+        uint32_t lo = crc ^ ((uint32_t) b[ii] | (uint32_t) b[ii + 1] << 8
+                | (uint32_t) b[ii + 2] << 16 | (uint32_t) b[ii + 3] << 24);
+        crc = T[7][lo & 0xff] ^ T[6][(lo >> 8) & 0xff]
+                ^ T[5][(lo >> 16) & 0xff] ^ T[4][lo >> 24]
+                ^ T[3][b[ii + 4]] ^ T[2][b[ii + 5]]
+                ^ T[1][b[ii + 6]] ^ T[0][b[ii + 7]];
+    }
+    for (; ii < nbytes; ii ++) {
+        crc = (crc >> 8) ^ T[0][(crc ^ b[ii]) & 0xff];
+    }
+    return ~crc;
+}
+
+
+#ifdef USESSE42
+BSHUF_TARGET_SSE42
+uint32_t bshuf_crc32c_SSE42(uint32_t crc, const void* buf,
+        const size_t nbytes) {
+
+    const uint8_t* b = (const uint8_t*) buf;
+    size_t ii = 0;
+
+    crc = ~crc;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; ii + 8 <= nbytes; ii += 8) {
+        uint64_t word;
+        memcpy(&word, b + ii, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    for (; ii + 4 <= nbytes; ii += 4) {
+        uint32_t word;
+        memcpy(&word, b + ii, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; ii < nbytes; ii ++) {
+        crc = _mm_crc32_u8(crc, b[ii]);
+    }
+    return ~crc;
+}
+#endif // #ifdef USESSE42
+
+
+#ifdef USEARMCRC
+uint32_t bshuf_crc32c_ARM(uint32_t crc, const void* buf,
+        const size_t nbytes) {
+
+    const uint8_t* b = (const uint8_t*) buf;
+    size_t ii = 0;
+
+    crc = ~crc;
+    for (; ii + 8 <= nbytes; ii += 8) {
+        uint64_t word;
+        memcpy(&word, b + ii, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; ii < nbytes; ii ++) {
+        crc = __crc32cb(crc, b[ii]);
+    }
+    return ~crc;
+}
+#endif // #ifdef USEARMCRC
+
+
+/* ---- Drivers selecting best instruction set at runtime. ---- */
+
+/* Whether the kernels for *isa* were compiled and the CPU can run them. */
+int bshuf_isa_available(const int isa) {
+    switch (isa) {
+        case BSHUF_ISA_SCAL:
+            return 1;
+        case BSHUF_ISA_SSE2:
+#if defined(BSHUF_DISPATCH)
+            return __builtin_cpu_supports("sse2");
+#elif defined(USESSE2)
+            return 1;
+#else
+            return 0;
+#endif
+        case BSHUF_ISA_AVX2:
+#if defined(BSHUF_DISPATCH)
+            return __builtin_cpu_supports("avx2");
+#elif defined(USEAVX2)
+            return 1;
+#else
+            return 0;
+#endif
+        case BSHUF_ISA_AVX512:
+#if defined(BSHUF_DISPATCH)
+            return __builtin_cpu_supports("avx512f")
+                && __builtin_cpu_supports("avx512bw");
+#elif defined(USEAVX512) && defined(USEAVX2)
+            return 1;
+#else
+            return 0;
+#endif
+        case BSHUF_ISA_NEON:
+#if defined(USENEON)
+            return 1;
+#else
+            return 0;
+#endif
+    }
+    return 0;
+}
+
+
+/* Whether the CPU has the crc32 instruction of SSE4.2. */
+int bshuf_sse42_available(void) {
+#if defined(BSHUF_DISPATCH)
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(USESSE42)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+int bshuf_select_isa(int isa) {
+
+    if (isa < 0) {
+        isa = BSHUF_ISA_NEON;
+        while (!bshuf_isa_available(isa)) isa --;
+    }
+    if (!bshuf_isa_available(isa)) return -10 - isa;
+
+    switch (isa) {
+        case BSHUF_ISA_NEON:
+            bshuf_trans_bit_elem_sel = &bshuf_trans_bit_elem_NEON;
+            bshuf_untrans_bit_elem_sel = &bshuf_untrans_bit_elem_NEON;
+            bshuf_trans_byte_elem_sel = &bshuf_trans_byte_elem_scal;
+            bshuf_trans_bit_byte_sel = &bshuf_trans_bit_byte_NEON;
+            bshuf_trans_byte_bitrow_sel = &bshuf_trans_byte_bitrow_scal;
+            bshuf_shuffle_bit_eightelem_sel = &bshuf_shuffle_bit_eightelem_NEON;
+            break;
+        case BSHUF_ISA_AVX512:
+            bshuf_trans_bit_elem_sel = &bshuf_trans_bit_elem_AVX512;
+            bshuf_untrans_bit_elem_sel = &bshuf_untrans_bit_elem_AVX512;
+            bshuf_trans_byte_elem_sel = &bshuf_trans_byte_elem_SSE;
+            bshuf_trans_bit_byte_sel = &bshuf_trans_bit_byte_AVX512;
+            bshuf_trans_byte_bitrow_sel = &bshuf_trans_byte_bitrow_AVX;
+            bshuf_shuffle_bit_eightelem_sel = &bshuf_shuffle_bit_eightelem_AVX512;
+            break;
+        case BSHUF_ISA_AVX2:
+            bshuf_trans_bit_elem_sel = &bshuf_trans_bit_elem_AVX;
+            bshuf_untrans_bit_elem_sel = &bshuf_untrans_bit_elem_AVX;
+            bshuf_trans_byte_elem_sel = &bshuf_trans_byte_elem_SSE;
+            bshuf_trans_bit_byte_sel = &bshuf_trans_bit_byte_AVX;
+            bshuf_trans_byte_bitrow_sel = &bshuf_trans_byte_bitrow_AVX;
+            bshuf_shuffle_bit_eightelem_sel = &bshuf_shuffle_bit_eightelem_AVX;
+            break;
+        case BSHUF_ISA_SSE2:
+            bshuf_trans_bit_elem_sel = &bshuf_trans_bit_elem_SSE;
+            bshuf_untrans_bit_elem_sel = &bshuf_untrans_bit_elem_SSE;
+            bshuf_trans_byte_elem_sel = &bshuf_trans_byte_elem_SSE;
+            bshuf_trans_bit_byte_sel = &bshuf_trans_bit_byte_SSE;
+            bshuf_trans_byte_bitrow_sel = &bshuf_trans_byte_bitrow_SSE;
+            bshuf_shuffle_bit_eightelem_sel = &bshuf_shuffle_bit_eightelem_SSE;
+            break;
+        default:
+            bshuf_trans_bit_elem_sel = &bshuf_trans_bit_elem_scal;
+            bshuf_untrans_bit_elem_sel = &bshuf_untrans_bit_elem_scal;
+            bshuf_trans_byte_elem_sel = &bshuf_trans_byte_elem_scal;
+            bshuf_trans_bit_byte_sel = &bshuf_trans_bit_byte_scal;
+            bshuf_trans_byte_bitrow_sel = &bshuf_trans_byte_bitrow_scal;
+            bshuf_shuffle_bit_eightelem_sel = &bshuf_shuffle_bit_eightelem_scal;
+    }
+
+    bshuf_crc32c_sel = &bshuf_crc32c_scal;
+#if defined(USESSE42)
+    if (isa >= BSHUF_ISA_SSE2 && isa <= BSHUF_ISA_AVX512
+            && bshuf_sse42_available()) {
+        bshuf_crc32c_sel = &bshuf_crc32c_SSE42;
+    }
+#elif defined(USEARMCRC)
+    if (isa == BSHUF_ISA_NEON) bshuf_crc32c_sel = &bshuf_crc32c_ARM;
+#endif
+    // Filled once, before any routine can use it.
+    if (bshuf_crc32c_table[0][1] == 0) bshuf_crc32c_init_table();
+
+    bshuf_isa = isa;
+    return isa;
+}
+
+
+int64_t bshuf_trans_bit_elem(void* in, void* out, const size_t size, 
+        const size_t elem_size) {
+
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_trans_bit_elem_sel(in, out, size, elem_size);
+}
+
+
+int64_t bshuf_untrans_bit_elem(void* in, void* out, const size_t size, 
+        const size_t elem_size) {
+
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_untrans_bit_elem_sel(in, out, size, elem_size);
+}
+
+
+uint32_t bshuf_crc32c(uint32_t crc, const void* buf, const size_t nbytes) {
+
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    return bshuf_crc32c_sel(crc, buf, nbytes);
+}
+
+
+/* Transpose bits within elements of *in* with their bytes reversed in groups
+ * of *swap_size*, see *bshuf_copy_swap*. The same passes as
+ * *bshuf_trans_bit_elem*; the reversal is folded into the last one. */
+int64_t bshuf_trans_bit_elem_swap(void* in, void* out, const size_t size,
+        const size_t elem_size, const size_t swap_size) {
+
+    int64_t count;
+
+    if (swap_size <= 1) return bshuf_trans_bit_elem(in, out, size, elem_size);
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+
+    CHECK_MULT_EIGHT(size);
+
+    void* tmp_buf = malloc(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+
+    count = bshuf_trans_byte_elem_sel(in, out, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count = bshuf_trans_bit_byte_sel(out, tmp_buf, size, elem_size);
+    CHECK_ERR_FREE(count, tmp_buf);
+    count = bshuf_trans_bitrow_eight_swap(tmp_buf, out, size, elem_size,
+            swap_size);
+
+    free(tmp_buf);
+
+    return count;
+}
+
+
+/* The passes of bitshuffle for one element size. */
+typedef struct bshuf_kernels {
+    bshufTransFunDef trans_byte_elem;   // Bitshuffle: bytes into rows,
+    bshufTransFunDef trans_bit_byte;    // then bits.
+    bshufTransFunDef trans_byte_bitrow; // Bitunshuffle: rows into bytes,
+    bshufTransFunDef shuffle_bit_eightelem; // then bits.
+} bshuf_kernels;
+
+
+/* The kernels of the selected instruction set for elements of *elem_size*,
+ * the specialized scalar ones where it has no vectorized kernel for them. */
+bshuf_kernels bshuf_kernels_select(const size_t elem_size) {
+
+    bshuf_kernels K;
+
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    K.trans_byte_elem = bshuf_trans_byte_elem_sel;
+    K.trans_bit_byte = bshuf_trans_bit_byte_sel;
+    K.trans_byte_bitrow = bshuf_trans_byte_bitrow_sel;
+    K.shuffle_bit_eightelem = bshuf_shuffle_bit_eightelem_sel;
+
+    // The SSE byte transpose has kernels for 1, 2, 4 and 8 bytes and
+    // multiples of 4, and otherwise falls back to the scalar loop.
+    int scal_bytes = bshuf_trans_byte_elem_sel == &bshuf_trans_byte_elem_scal;
+    if (scal_bytes || (elem_size > 2 && elem_size % 4)) {
+        switch (elem_size) {
+            case 1:
+                K.trans_byte_elem = &bshuf_copy;
+                break;
+            case 2:
+                K.trans_byte_elem = &bshuf_trans_byte_elem_scal_2;
+                break;
+            case 4:
+                // No faster than the loop for any size.
+                break;
+            case 8:
+                K.trans_byte_elem = &bshuf_trans_byte_elem_scal_8;
+                break;
+            case 16:
+                K.trans_byte_elem = &bshuf_trans_byte_elem_scal_16;
+                break;
+            default:
+                if (elem_size > 8) {
+                    K.trans_byte_elem = &bshuf_trans_byte_elem_wide;
+                }
+        }
+    }
+    if (K.trans_byte_bitrow == &bshuf_trans_byte_bitrow_scal) {
+        switch (elem_size) {
+            case 1:
+                K.trans_byte_bitrow = &bshuf_trans_byte_bitrow_scal_1;
+                break;
+            case 2:
+                K.trans_byte_bitrow = &bshuf_trans_byte_bitrow_scal_2;
+                break;
+            case 4:
+                K.trans_byte_bitrow = &bshuf_trans_byte_bitrow_scal_4;
+                break;
+            case 8:
+                K.trans_byte_bitrow = &bshuf_trans_byte_bitrow_scal_8;
+                break;
+            case 16:
+                K.trans_byte_bitrow = &bshuf_trans_byte_bitrow_scal_16;
+                break;
+        }
+    }
+    // The vectorized bit shuffles fall back to the scalar loop for odd sizes.
+    if (K.shuffle_bit_eightelem == &bshuf_shuffle_bit_eightelem_scal
+            || elem_size % 2) {
+        switch (elem_size) {
+            case 1:
+                K.shuffle_bit_eightelem = &bshuf_shuffle_bit_eightelem_scal_1;
+                break;
+            case 2:
+                K.shuffle_bit_eightelem = &bshuf_shuffle_bit_eightelem_scal_2;
+                break;
+            case 4:
+                K.shuffle_bit_eightelem = &bshuf_shuffle_bit_eightelem_scal_4;
+                break;
+            case 8:
+                K.shuffle_bit_eightelem = &bshuf_shuffle_bit_eightelem_scal_8;
+                break;
+            case 16:
+                K.shuffle_bit_eightelem =
+                    &bshuf_shuffle_bit_eightelem_scal_16;
+                break;
+            default:
+                K.shuffle_bit_eightelem = &bshuf_shuffle_bit_eightelem_scal;
+        }
+    }
+    return K;
+}
+
+
+/* ---- Wrappers for implementing blocking ---- */
+
+// The options of a routine, see *bshuf_opts* in the header, are handed to
+// every block through its workspace.
+const bshuf_opts bshuf_opts_none = {0, 0, NULL, 0};
+
+
+/* What one thread did in a routine, while stats are counted. */
+typedef struct bshuf_ws_stats {
+    uint64_t blocks;    // Blocks processed.
+    double busy;        // Processing blocks and copying their output.
+    double shuffle;     // Of busy, in bitshuffle and byte swaps.
+    double codec;       // Of busy, in LZ4 or zlib.
+    double copy;        // Of busy, copying output into place.
+} bshuf_ws_stats;
+
+
+/* Scratch space for processing a single block. Each thread gets its own, so the
+ * worker functions never allocate. */
+typedef struct bshuf_ws {
+    void* buf;          // block_size * elem_size bytes.
+    void* buf_lz4;      // LZ4_compressBound(block_size * elem_size) bytes.
+    void* lz4_state;    // LZ4_sizeofState() bytes, 4 byte aligned.
+    void* gather;       // block_size * elem_size bytes, strided input gathered.
+    bshuf_opts opts;    // Options of the routine processing the blocks.
+    bshuf_kernels kern; // Bitshuffle passes for its element size.
+    int timed;          // Whether stats are counted, see *bshuf_stats_enable*.
+    bshuf_ws_stats stats;   // Counters of the thread, for *bshuf_stats_add*.
+} bshuf_ws;
+
+
+// Whether the routines count their work, and the counts so far. The totals are
+// only touched in the bshuf_stats critical section.
+static int bshuf_stats_on = 0;
+static bshuf_stats bshuf_stats_total;
+
+
+/* Seconds since some fixed point in the past. */
+static double bshuf_now(void) {
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+/* The time now if the stats of *W* are counted, else 0 without reading the
+ * clock. */
+static double bshuf_tic(const bshuf_ws* W) {
+    return W->timed ? bshuf_now() : 0;
+}
+
+
+/* Add the time since *t0*, from *bshuf_tic*, to *acc*. */
+static void bshuf_toc(const bshuf_ws* W, double* acc, const double t0) {
+    if (W->timed) *acc += bshuf_now() - t0;
+}
+
+
+/* Round up to a multiple of the cache line size. */
+#define BSHUF_ALIGN_UP(n) (((n) + 63) / 64 * 64)
+
+
+/* Allocate scratch space for *nthreads* threads processing blocks of at most
+ * *nbytes* bytes. Release with *bshuf_ws_free*. */
+bshuf_ws* bshuf_ws_alloc(const int nthreads, const size_t nbytes) {
+
+    size_t nbytes_buf = BSHUF_ALIGN_UP(nbytes);
+    size_t nbytes_lz4 = BSHUF_ALIGN_UP(LZ4_compressBound(nbytes));
+    size_t nbytes_state = BSHUF_ALIGN_UP(LZ4_sizeofState());
+    size_t stride = 2 * nbytes_buf + nbytes_lz4 + nbytes_state;
+
+    bshuf_ws* W = malloc(nthreads * sizeof(bshuf_ws));
+    if (W == NULL) return NULL;
+    char* arena = malloc(nthreads * stride);
+    if (arena == NULL) {
+        free(W);
+        return NULL;
+    }
+    for (int ii = 0; ii < nthreads; ii ++) {
+        W[ii].buf = arena + ii * stride;
+        W[ii].buf_lz4 = arena + ii * stride + nbytes_buf;
+        W[ii].lz4_state = arena + ii * stride + nbytes_buf + nbytes_lz4;
+        W[ii].gather = arena + ii * stride + nbytes_buf + nbytes_lz4
+                + nbytes_state;
+        W[ii].timed = bshuf_stats_on;
+        memset(&W[ii].stats, 0, sizeof(bshuf_ws_stats));
+    }
+    return W;
+}
+
+
+void bshuf_ws_free(bshuf_ws* W) {
+    free(W[0].buf);
+    free(W);
+}
+
+
+/* Index of the calling thread, selecting its scratch space. */
+int bshuf_thread_num(void) {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+
+int bshuf_set_num_threads(int nthreads) {
+    int old = 1;
+#ifdef _OPENMP
+    old = omp_get_max_threads();
+    if (nthreads > 0) omp_set_num_threads(nthreads);
+#endif
+    return old;
+}
+
+
+/* Add the counters of the *nthreads* workspaces of a routine that started at
+ * *t_start* and spent *t_region* in its parallel region to the totals. */
+void bshuf_stats_add(const bshuf_ws* W, const int nthreads, const double t_start,
+        const double t_region, const uint64_t bytes_in,
+        const uint64_t bytes_out) {
+
+    if (!W[0].timed) return;
+    double wall = bshuf_now() - t_start;
+
+    #pragma omp critical (bshuf_stats)
+    {
+        bshuf_stats* S = &bshuf_stats_total;
+        int used = 0;
+        S->calls ++;
+        S->bytes_in += bytes_in;
+        S->bytes_out += bytes_out;
+        S->wall_time += wall;
+        for (int ii = 0; ii < nthreads; ii ++) {
+            const bshuf_ws_stats* T = &W[ii].stats;
+            int slot = MIN(ii, BSHUF_STATS_MAX_THREADS - 1);
+            S->blocks += T->blocks;
+            S->shuffle_time += T->shuffle;
+            S->codec_time += T->codec;
+            S->copy_time += T->copy;
+            S->thread_blocks[slot] += T->blocks;
+            S->thread_time[slot] += T->busy;
+            // A thread with no blocks may not have been started at all.
+            if (T->blocks) {
+                S->wait_time += MAX(t_region - T->busy, 0);
+                used ++;
+            }
+        }
+        S->max_threads = MAX(S->max_threads, used);
+    }
+}
+
+
+/* Number of threads a parallel region wants, never more than *nblock*. */
+int bshuf_max_threads(const size_t nblock) {
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    if ((size_t) nthreads > nblock) nthreads = nblock;
+    return MAX(nthreads, 1);
+}
+
+
+/* Function definition for worker functions that process a single block.
+ *
+ * Reads *size* elements from *in* or writes them to *out*. Returns the number
+ * of bytes written to *out* for encoders and the number of bytes read from
+ * *in* for decoders, negative error-code if failed.
+ */
+typedef int64_t (*bshufBlockFunDef)(bshuf_ws* W, void* in, void* out,
+        const size_t size, const size_t elem_size);
+
+
+/* Wrap a function for processing a single block to process an entire buffer in
+ * parallel.
+ *
+ * For functions whose output is the same size as their input, so the location
+ * of every block is known up front. The elements not fitting into any block
+ * are copied, byte swapped by *opts->swap_size*.
+ */
+int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
+        const size_t size, const size_t elem_size, size_t block_size,
+        const bshuf_opts* opts) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    int64_t err = 0, count, cum_count = 0;
+    size_t nblock, last_block_size;
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+
+    last_block_size = size % block_size;
+    last_block_size = last_block_size - last_block_size % BSHUF_BLOCKED_MULT;
+    nblock = size / block_size + (last_block_size ? 1 : 0);
+
+    int nthreads = bshuf_max_threads(nblock);
+    bshuf_ws* W = bshuf_ws_alloc(nthreads, block_size * elem_size);
+    if (W == NULL) return -1;
+    bshuf_kernels K = bshuf_kernels_select(elem_size);
+    for (int ii = 0; ii < nthreads; ii ++) {
+        W[ii].opts = *opts;
+        W[ii].kern = K;
+    }
+    double t_start = bshuf_tic(W);
+
+    #pragma omp parallel for num_threads(nthreads) private(count) \
+            reduction(+ : cum_count)
+    for (size_t ii = 0; ii < nblock; ii ++) {
+        size_t this_size = ii < size / block_size ? block_size
+                : last_block_size;
+        size_t start = ii * block_size * elem_size;
+        bshuf_ws* w = &W[bshuf_thread_num()];
+        double t = bshuf_tic(w);
+        count = fun(w, in_b + start, out_b + start, this_size, elem_size);
+        bshuf_toc(w, &w->stats.busy, t);
+        w->stats.blocks ++;
+        if (count < 0) err = count;
+        cum_count += count;
+    }
+    double t_region = bshuf_tic(W) - t_start;
+
+    size_t leftover_bytes = size % BSHUF_BLOCKED_MULT * elem_size;
+    size_t leftover_start = size * elem_size - leftover_bytes;
+    if (err == 0) {
+        double t = bshuf_tic(W);
+        err = bshuf_copy_swap(in_b + leftover_start, out_b + leftover_start,
+                size % BSHUF_BLOCKED_MULT, elem_size, opts->swap_size);
+        bshuf_toc(W, &W->stats.copy, t);
+    }
+    if (err >= 0) {
+        bshuf_stats_add(W, nthreads, t_start, t_region, size * elem_size,
+                size * elem_size);
+    }
+    bshuf_ws_free(W);
+    if (err < 0) return err;
+
+    return cum_count + leftover_bytes;
+}
+
+
+/* ---- Filters ----
+ *
+ * Numbers are loaded and stored byte swapped where asked, so the filters
+ * work on the values whatever the byte order of the input and of the
+ * stored data.
+ */
+
+static inline uint8_t bshuf_bswap8(uint8_t x) {
+    return x;
+}
+
+static inline uint16_t bshuf_bswap16(uint16_t x) {
+    return (uint16_t) ((x >> 8) | (x << 8));
+}
+
+static inline uint32_t bshuf_bswap32(uint32_t x) {
+    return ((x >> 24) & 0xff) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000)
+        | (x << 24);
+}
+
+static inline uint64_t bshuf_bswap64(uint64_t x) {
+    return ((uint64_t) bshuf_bswap32((uint32_t) x) << 32)
+        | bshuf_bswap32((uint32_t) (x >> 32));
+}
+
+// Filter of the numbers of type T from *in* to *out*, which may be the same:
+// from element *top* down, so the numbers looked back at are still intact,
+// the vector kernels having done those above. The first *dist* numbers are
+// kept as they are. Inlined with constant flags, so every combination of
+// them is a loop of its own.
+#define BSHUF_FILTER_LOOPS(T, BITS)                                         \
+static inline T bshuf_load##BITS(const char* p, const int swap) {           \
+    T v;                                                                    \
+    memcpy(&v, p, sizeof(T));                                               \
+    return swap ? bshuf_bswap##BITS(v) : v;                                 \
+}                                                                           \
+                                                                            \
+static inline void bshuf_store##BITS(char* p, T v, const int swap) {        \
+    if (swap) v = bshuf_bswap##BITS(v);                                     \
+    memcpy(p, &v, sizeof(T));                                               \
+}                                                                           \
+                                                                            \
+static inline void bshuf_filter_encode_loop##BITS(const char* in,           \
+        char* out, const size_t top, const size_t size, const size_t dist,  \
+        const int use_xor, const int swap_in, const int swap_out) {         \
+    const size_t n = sizeof(T);                                             \
+    const size_t head = MIN(dist, size);                                    \
+    for (size_t ii = top; ii-- > head;) {                                   \
+        T v = bshuf_load##BITS(in + ii * n, swap_in);                       \
+        T p = bshuf_load##BITS(in + (ii - dist) * n, swap_in);              \
+        bshuf_store##BITS(out + ii * n,                                     \
+                use_xor ? (T) (v ^ p) : (T) (v - p), swap_out);             \
+    }                                                                       \
+    if (in == out && swap_in == swap_out) return;                           \
+    for (size_t ii = 0; ii < head; ii ++) {                                 \
+        bshuf_store##BITS(out + ii * n,                                     \
+                bshuf_load##BITS(in + ii * n, swap_in), swap_out);          \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+static inline void bshuf_filter_decode_loop##BITS(char* buf,                \
+        const size_t start, const size_t size, const size_t dist,           \
+        const int use_xor, const int swap) {                                \
+    const size_t n = sizeof(T);                                             \
+    for (size_t ii = MAX(start, dist); ii < size; ii ++) {                  \
+        T f = bshuf_load##BITS(buf + ii * n, swap);                         \
+        T p = bshuf_load##BITS(buf + (ii - dist) * n, swap);                \
+        bshuf_store##BITS(buf + ii * n,                                     \
+                use_xor ? (T) (f ^ p) : (T) (f + p), swap);                 \
+    }                                                                       \
+}
+
+BSHUF_FILTER_LOOPS(uint8_t, 8)
+BSHUF_FILTER_LOOPS(uint16_t, 16)
+BSHUF_FILTER_LOOPS(uint32_t, 32)
+BSHUF_FILTER_LOOPS(uint64_t, 64)
+
+
+// The same with SSE2 and AVX2, 16 or 32 bytes of numbers at a time. The
+// encoders return the element below which the scalar loop goes on, the
+// decoders the one from which it does. Decoding is a running sum unless
+// *dist* spans a whole vector; for the previous number that is done in the
+// register, other short distances are left to the scalar loop.
+#ifdef USESSE2
+
+/* Reverse the bytes of each number in x. */
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_bswap_SSE8(__m128i x) {
+    return x;
+}
+
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_bswap_SSE16(__m128i x) {
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_bswap_SSE32(__m128i x) {
+    x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+    return bshuf_bswap_SSE16(x);
+}
+
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_bswap_SSE64(__m128i x) {
+    x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0x1B), 0x1B);
+    return bshuf_bswap_SSE16(x);
+}
+
+/* The last number of x in every position. */
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_last_SSE8(__m128i x) {
+    x = _mm_shufflehi_epi16(_mm_unpackhi_epi8(x, x), 0xFF);
+    return _mm_shuffle_epi32(x, 0xFF);
+}
+
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_last_SSE16(__m128i x) {
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xFF), 0xFF);
+}
+
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_last_SSE32(__m128i x) {
+    return _mm_shuffle_epi32(x, 0xFF);
+}
+
+BSHUF_TARGET_SSE2
+static inline __m128i bshuf_last_SSE64(__m128i x) {
+    return _mm_shuffle_epi32(x, 0xEE);
+}
+
+#define BSHUF_FILTER_SSE(BITS)                                              \
+BSHUF_TARGET_SSE2                                                           \
+static inline size_t bshuf_filter_encode_SSE_loop##BITS(const char* in,     \
+        char* out, const size_t top, const size_t dist, const int use_xor,  \
+        const int swap_in, const int swap_out) {                            \
+    const size_t n = BITS / 8;                                              \
+    size_t ii = top;                                                        \
+    while (ii >= dist + 16 / n) {                                           \
+        ii -= 16 / n;                                                       \
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + ii * n));        \
+        __m128i p = _mm_loadu_si128((const __m128i*)                        \
+                (in + (ii - dist) * n));                                    \
+        if (swap_in) {                                                      \
+            v = bshuf_bswap_SSE##BITS(v);                                   \
+            p = bshuf_bswap_SSE##BITS(p);                                   \
+        }                                                                   \
+        v = use_xor ? _mm_xor_si128(v, p) : _mm_sub_epi##BITS(v, p);        \
+        if (swap_out) v = bshuf_bswap_SSE##BITS(v);                         \
+        _mm_storeu_si128((__m128i*) (out + ii * n), v);                     \
+    }                                                                       \
+    return ii;                                                              \
+}                                                                           \
+                                                                            \
+BSHUF_TARGET_SSE2                                                           \
+static inline __m128i bshuf_filter_decode_SSE_op##BITS(__m128i f,           \
+        __m128i p, const int use_xor) {                                     \
+    return use_xor ? _mm_xor_si128(f, p) : _mm_add_epi##BITS(f, p);         \
+}                                                                           \
+                                                                            \
+BSHUF_TARGET_SSE2                                                           \
+static inline size_t bshuf_filter_decode_SSE_loop##BITS(char* buf,          \
+        const size_t size, const size_t dist, const int use_xor,            \
+        const int swap) {                                                   \
+    const size_t n = BITS / 8;                                              \
+    size_t ii = dist;                                                       \
+    if (dist >= 16 / n) {                                                   \
+        for (; ii + 16 / n <= size; ii += 16 / n) {                         \
+            __m128i f = _mm_loadu_si128((__m128i*) (buf + ii * n));         \
+            __m128i p = _mm_loadu_si128(                                    \
+                    (__m128i*) (buf + (ii - dist) * n));                    \
+            if (swap) {                                                     \
+                f = bshuf_bswap_SSE##BITS(f);                               \
+                p = bshuf_bswap_SSE##BITS(p);                               \
+            }                                                               \
+            f = bshuf_filter_decode_SSE_op##BITS(f, p, use_xor);            \
+            if (swap) f = bshuf_bswap_SSE##BITS(f);                         \
+            _mm_storeu_si128((__m128i*) (buf + ii * n), f);                 \
+        }                                                                   \
+    } else if (dist == 1) {                                                 \
+        __m128i carry = _mm_setzero_si128();                                \
+        for (ii = 0; ii + 16 / n <= size; ii += 16 / n) {                   \
+            __m128i f = _mm_loadu_si128((__m128i*) (buf + ii * n));         \
+            if (swap) f = bshuf_bswap_SSE##BITS(f);                         \
+            /* Sums of 2, 4, 8 and 16 numbers, in log steps. */             \
+            f = bshuf_filter_decode_SSE_op##BITS(f,                         \
+                    _mm_slli_si128(f, BITS / 8), use_xor);                  \
+            if (BITS < 64) f = bshuf_filter_decode_SSE_op##BITS(f,          \
+                    _mm_slli_si128(f, BITS / 4), use_xor);                  \
+            if (BITS < 32) f = bshuf_filter_decode_SSE_op##BITS(f,          \
+                    _mm_slli_si128(f, BITS / 2), use_xor);                  \
+            if (BITS < 16) f = bshuf_filter_decode_SSE_op##BITS(f,          \
+                    _mm_slli_si128(f, BITS), use_xor);                      \
+            f = bshuf_filter_decode_SSE_op##BITS(f, carry, use_xor);        \
+            carry = bshuf_last_SSE##BITS(f);                                \
+            if (swap) f = bshuf_bswap_SSE##BITS(f);                         \
+            _mm_storeu_si128((__m128i*) (buf + ii * n), f);                 \
+        }                                                                   \
+    }                                                                       \
+    return ii;                                                              \
+}                                                                           \
+                                                                            \
+BSHUF_TARGET_SSE2                                                           \
+static size_t bshuf_filter_encode_SSE##BITS(const char* in, char* out,      \
+        const size_t top, const size_t dist, const int use_xor,             \
+        const int swap_in, const int swap_out) {                            \
+    /* The xor of numbers is that of their bytes, in either order. */       \
+    if (use_xor && swap_in != swap_out) {                                   \
+        return bshuf_filter_encode_SSE_loop##BITS(in, out, top, dist,       \
+                1, 0, 1);                                                   \
+    } else if (use_xor) {                                                   \
+        return bshuf_filter_encode_SSE_loop##BITS(in, out, top, dist,       \
+                1, 0, 0);                                                   \
+    } else if (swap_in && swap_out) {                                       \
+        return bshuf_filter_encode_SSE_loop##BITS(in, out, top, dist,       \
+                0, 1, 1);                                                   \
+    } else if (swap_in) {                                                   \
+        return bshuf_filter_encode_SSE_loop##BITS(in, out, top, dist,       \
+                0, 1, 0);                                                   \
+    } else if (swap_out) {                                                  \
+        return bshuf_filter_encode_SSE_loop##BITS(in, out, top, dist,       \
+                0, 0, 1);                                                   \
+    }                                                                       \
+    return bshuf_filter_encode_SSE_loop##BITS(in, out, top, dist,           \
+            0, 0, 0);                                                       \
+}                                                                           \
+                                                                            \
+BSHUF_TARGET_SSE2                                                           \
+static size_t bshuf_filter_decode_SSE##BITS(char* buf, const size_t size,   \
+        const size_t dist, const int use_xor, const int swap) {             \
+    if (use_xor) {                                                          \
+        return bshuf_filter_decode_SSE_loop##BITS(buf, size, dist, 1, 0);   \
+    }                                                                       \
+    return swap ? bshuf_filter_decode_SSE_loop##BITS(buf, size, dist, 0, 1) \
+        : bshuf_filter_decode_SSE_loop##BITS(buf, size, dist, 0, 0);        \
+}
+
+#else // #ifdef USESSE2
+
+#define BSHUF_FILTER_SSE(BITS)                                              \
+static inline size_t bshuf_filter_encode_SSE##BITS(const char* in,          \
+        char* out, const size_t top, const size_t dist, const int use_xor,  \
+        const int swap_in, const int swap_out) {                            \
+    return top;                                                             \
+}                                                                           \
+                                                                            \
+static inline size_t bshuf_filter_decode_SSE##BITS(char* buf,               \
+        const size_t size, const size_t dist, const int use_xor,            \
+        const int swap) {                                                   \
+    return dist;                                                            \
+}
+
+#endif // #ifdef USESSE2
+
+BSHUF_FILTER_SSE(8)
+BSHUF_FILTER_SSE(16)
+BSHUF_FILTER_SSE(32)
+BSHUF_FILTER_SSE(64)
+
+
+#ifdef USEAVX2
+
+/* Reverse the bytes of each number in x. */
+BSHUF_TARGET_AVX2
+static inline __m256i bshuf_bswap_AVX8(__m256i x) {
+    return x;
+}
+
+BSHUF_TARGET_AVX2
+static inline __m256i bshuf_bswap_AVX16(__m256i x) {
+    return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+}
+
+BSHUF_TARGET_AVX2
+static inline __m256i bshuf_bswap_AVX32(__m256i x) {
+    return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+}
+
+BSHUF_TARGET_AVX2
+static inline __m256i bshuf_bswap_AVX64(__m256i x) {
+    return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+}
+
+#define BSHUF_FILTER_AVX(BITS)                                              \
+BSHUF_TARGET_AVX2                                                           \
+static inline size_t bshuf_filter_encode_AVX_loop##BITS(const char* in,     \
+        char* out, const size_t top, const size_t dist, const int use_xor,  \
+        const int swap_in, const int swap_out) {                            \
+    const size_t n = BITS / 8;                                              \
+    size_t ii = top;                                                        \
+    while (ii >= dist + 32 / n) {                                           \
+        ii -= 32 / n;                                                       \
+        __m256i v = _mm256_loadu_si256((const __m256i*) (in + ii * n));     \
+        __m256i p = _mm256_loadu_si256(                                     \
+                (const __m256i*) (in + (ii - dist) * n));                   \
+        if (swap_in) {                                                      \
+            v = bshuf_bswap_AVX##BITS(v);                                   \
+            p = bshuf_bswap_AVX##BITS(p);                                   \
+        }                                                                   \
+        v = use_xor ? _mm256_xor_si256(v, p) : _mm256_sub_epi##BITS(v, p);  \
+        if (swap_out) v = bshuf_bswap_AVX##BITS(v);                         \
+        _mm256_storeu_si256((__m256i*) (out + ii * n), v);                  \
+    }                                                                       \
+    return ii;                                                              \
+}                                                                           \
+                                                                            \
+BSHUF_TARGET_AVX2                                                           \
+static inline size_t bshuf_filter_decode_AVX_loop##BITS(char* buf,          \
+        const size_t size, const size_t dist, const int use_xor,            \
+        const int swap) {                                                   \
+    const size_t n = BITS / 8;                                              \
+    size_t ii = dist;                                                       \
+    for (; ii + 32 / n <= size; ii += 32 / n) {                             \
+        __m256i f = _mm256_loadu_si256((__m256i*) (buf + ii * n));          \
+        __m256i p = _mm256_loadu_si256((__m256i*) (buf + (ii - dist) * n)); \
+        if (swap) {                                                         \
+            f = bshuf_bswap_AVX##BITS(f);                                   \
+            p = bshuf_bswap_AVX##BITS(p);                                   \
+        }                                                                   \
+        f = use_xor ? _mm256_xor_si256(f, p) : _mm256_add_epi##BITS(f, p);  \
+        if (swap) f = bshuf_bswap_AVX##BITS(f);                             \
+        _mm256_storeu_si256((__m256i*) (buf + ii * n), f);                  \
+    }                                                                       \
+    return ii;                                                              \
+}                                                                           \
+                                                                            \
+BSHUF_TARGET_AVX2                                                           \
+static size_t bshuf_filter_encode_AVX##BITS(const char* in, char* out,      \
+        const size_t top, const size_t dist, const int use_xor,             \
+        const int swap_in, const int swap_out) {                            \
+    if (use_xor && swap_in != swap_out) {                                   \
+        return bshuf_filter_encode_AVX_loop##BITS(in, out, top, dist,       \
+                1, 0, 1);                                                   \
+    } else if (use_xor) {                                                   \
+        return bshuf_filter_encode_AVX_loop##BITS(in, out, top, dist,       \
+                1, 0, 0);                                                   \
+    } else if (swap_in && swap_out) {                                       \
+        return bshuf_filter_encode_AVX_loop##BITS(in, out, top, dist,       \
+                0, 1, 1);                                                   \
+    } else if (swap_in) {                                                   \
+        return bshuf_filter_encode_AVX_loop##BITS(in, out, top, dist,       \
+                0, 1, 0);                                                   \
+    } else if (swap_out) {                                                  \
+        return bshuf_filter_encode_AVX_loop##BITS(in, out, top, dist,       \
+                0, 0, 1);                                                   \
+    }                                                                       \
+    return bshuf_filter_encode_AVX_loop##BITS(in, out, top, dist,           \
+            0, 0, 0);                                                       \
+}                                                                           \
+                                                                            \
+/* Only for *dist* of at least a vector. */                                 \
+BSHUF_TARGET_AVX2                                                           \
+static size_t bshuf_filter_decode_AVX##BITS(char* buf, const size_t size,   \
+        const size_t dist, const int use_xor, const int swap) {             \
+    if (use_xor) {                                                          \
+        return bshuf_filter_decode_AVX_loop##BITS(buf, size, dist, 1, 0);   \
+    }                                                                       \
+    return swap ? bshuf_filter_decode_AVX_loop##BITS(buf, size, dist, 0, 1) \
+        : bshuf_filter_decode_AVX_loop##BITS(buf, size, dist, 0, 0);        \
+}
+
+#else // #ifdef USEAVX2
+
+#define BSHUF_FILTER_AVX(BITS)                                              \
+static inline size_t bshuf_filter_encode_AVX##BITS(const char* in,          \
+        char* out, const size_t top, const size_t dist, const int use_xor,  \
+        const int swap_in, const int swap_out) {                            \
+    return top;                                                             \
+}                                                                           \
+                                                                            \
+static inline size_t bshuf_filter_decode_AVX##BITS(char* buf,               \
+        const size_t size, const size_t dist, const int use_xor,            \
+        const int swap) {                                                   \
+    return dist;                                                            \
+}
+
+#endif // #ifdef USEAVX2
+
+BSHUF_FILTER_AVX(8)
+BSHUF_FILTER_AVX(16)
+BSHUF_FILTER_AVX(32)
+BSHUF_FILTER_AVX(64)
+
+
+// The filters of numbers of BITS bits: the vector kernels of the selected
+// instruction set, then the scalar loop for the rest.
+#define BSHUF_FILTER_FUNS(BITS)                                             \
+static void bshuf_filter_encode##BITS(const char* in, char* out,            \
+        const size_t size, const size_t dist, const int use_xor,            \
+        const int swap_in, const int swap_out) {                            \
+    size_t top = size;                                                      \
+    if (bshuf_isa == BSHUF_ISA_AVX2 || bshuf_isa == BSHUF_ISA_AVX512) {     \
+        top = bshuf_filter_encode_AVX##BITS(in, out, top, dist, use_xor,    \
+                swap_in, swap_out);                                         \
+    }                                                                       \
+    if (bshuf_isa >= BSHUF_ISA_SSE2 && bshuf_isa <= BSHUF_ISA_AVX512) {     \
+        top = bshuf_filter_encode_SSE##BITS(in, out, top, dist, use_xor,    \
+                swap_in, swap_out);                                         \
+    }                                                                       \
+    if (use_xor) {                                                          \
+        if (swap_in != swap_out) {                                          \
+            bshuf_filter_encode_loop##BITS(in, out, top, size, dist,        \
+                    1, 0, 1);                                               \
+        } else {                                                            \
+            bshuf_filter_encode_loop##BITS(in, out, top, size, dist,        \
+                    1, 0, 0);                                               \
+        }                                                                   \
+    } else if (swap_in && swap_out) {                                       \
+        bshuf_filter_encode_loop##BITS(in, out, top, size, dist,            \
+                0, 1, 1);                                                   \
+    } else if (swap_in) {                                                   \
+        bshuf_filter_encode_loop##BITS(in, out, top, size, dist,            \
+                0, 1, 0);                                                   \
+    } else if (swap_out) {                                                  \
+        bshuf_filter_encode_loop##BITS(in, out, top, size, dist,            \
+                0, 0, 1);                                                   \
+    } else {                                                                \
+        bshuf_filter_encode_loop##BITS(in, out, top, size, dist,            \
+                0, 0, 0);                                                   \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+static void bshuf_filter_decode##BITS(char* buf, const size_t size,         \
+        const size_t dist, const int use_xor, const int swap) {             \
+    size_t start = dist;                                                    \
+    if ((bshuf_isa == BSHUF_ISA_AVX2 || bshuf_isa == BSHUF_ISA_AVX512)      \
+            && dist >= 256 / BITS) {                                        \
+        start = bshuf_filter_decode_AVX##BITS(buf, size, dist, use_xor,     \
+                swap);                                                      \
+    } else if (bshuf_isa >= BSHUF_ISA_SSE2                                  \
+            && bshuf_isa <= BSHUF_ISA_AVX512) {                             \
+        start = bshuf_filter_decode_SSE##BITS(buf, size, dist, use_xor,     \
+                swap);                                                      \
+    }                                                                       \
+    if (use_xor) {                                                          \
+        bshuf_filter_decode_loop##BITS(buf, start, size, dist, 1, 0);       \
+    } else if (swap) {                                                      \
+        bshuf_filter_decode_loop##BITS(buf, start, size, dist, 0, 1);       \
+    } else {                                                                \
+        bshuf_filter_decode_loop##BITS(buf, start, size, dist, 0, 0);       \
+    }                                                                       \
+}
+
+BSHUF_FILTER_FUNS(8)
+BSHUF_FILTER_FUNS(16)
+BSHUF_FILTER_FUNS(32)
+BSHUF_FILTER_FUNS(64)
+
+
+/* Filter the *size* elements of a block from *in* to *out*, as *opts* asks:
+ * the input is byte swapped by *opts->swap_size*, the output is in the byte
+ * order the data is stored in. *in* and *out* may be the same. */
+int64_t bshuf_filter_encode(const void* in, void* out, const size_t size,
+        const size_t elem_size, const bshuf_opts* opts) {
+
+    const char* in_b = (const char*) in;
+    char* out_b = (char*) out;
+    size_t dist = opts->filter_distance ? opts->filter_distance : 1;
+    int use_xor = opts->filter == BSHUF_FILTER_XOR;
+    int swap_out = opts->filter_swap != 0;
+    int swap_in = swap_out ^ (opts->swap_size > 1);
+
+    if (opts->filter != BSHUF_FILTER_DELTA && !use_xor) return -85;
+    if (opts->swap_size > 1 && opts->swap_size != elem_size) return -85;
+    switch (elem_size) {
+        case 1:
+            bshuf_filter_encode8(in_b, out_b, size, dist, use_xor, 0, 0);
+            break;
+        case 2:
+            bshuf_filter_encode16(in_b, out_b, size, dist, use_xor, swap_in,
+                    swap_out);
+            break;
+        case 4:
+            bshuf_filter_encode32(in_b, out_b, size, dist, use_xor, swap_in,
+                    swap_out);
+            break;
+        case 8:
+            bshuf_filter_encode64(in_b, out_b, size, dist, use_xor, swap_in,
+                    swap_out);
+            break;
+        default:
+            return -85;
+    }
+    return size * elem_size;
+}
+
+
+/* Undo *bshuf_filter_encode* of the *size* elements of a block, in place. */
+int64_t bshuf_filter_decode(void* buf, const size_t size,
+        const size_t elem_size, const bshuf_opts* opts) {
+
+    char* buf_b = (char*) buf;
+    size_t dist = opts->filter_distance ? opts->filter_distance : 1;
+    int use_xor = opts->filter == BSHUF_FILTER_XOR;
+    int swap = opts->filter_swap != 0;
+
+    if (opts->filter != BSHUF_FILTER_DELTA && !use_xor) return -85;
+    switch (elem_size) {
+        case 1:
+            bshuf_filter_decode8(buf_b, size, dist, use_xor, 0);
+            break;
+        case 2:
+            bshuf_filter_decode16(buf_b, size, dist, use_xor, swap);
+            break;
+        case 4:
+            bshuf_filter_decode32(buf_b, size, dist, use_xor, swap);
+            break;
+        case 8:
+            bshuf_filter_decode64(buf_b, size, dist, use_xor, swap);
+            break;
+        default:
+            return -85;
+    }
+    return size * elem_size;
+}
+
+
+/* Gather *size* elements *stride* bytes apart in *in* into *out*. */
+void bshuf_gather(const void* in, void* out, const size_t size,
+        const size_t elem_size, const size_t stride) {
+
+    const char* in_b = (const char*) in;
+    char* out_b = (char*) out;
+
+    // Fixed size copies of numbers are a single load and store.
+    switch (elem_size) {
+        case 1:
+            for (size_t ii = 0; ii < size; ii ++) {
+                out_b[ii] = in_b[ii * stride];
+            }
+            break;
+        case 2:
+            for (size_t ii = 0; ii < size; ii ++) {
+                memcpy(out_b + ii * 2, in_b + ii * stride, 2);
+            }
+            break;
+        case 4:
+            for (size_t ii = 0; ii < size; ii ++) {
+                memcpy(out_b + ii * 4, in_b + ii * stride, 4);
+            }
+            break;
+        case 8:
+            for (size_t ii = 0; ii < size; ii ++) {
+                memcpy(out_b + ii * 8, in_b + ii * stride, 8);
+            }
+            break;
+        default:
+            for (size_t ii = 0; ii < size; ii ++) {
+                memcpy(out_b + ii * elem_size, in_b + ii * stride,
+                        elem_size);
+            }
+    }
+}
+
+
+/* Write a 32 bit unsigned integer to a buffer in big endian order. */
+void bshuf_write_uint32_BE(void* buf, uint32_t num) {
+    uint8_t* b = buf;
+    uint32_t pow28 = 1 << 8;
+    for (int ii = 3; ii >= 0; ii--) {
+        b[ii] = num % pow28;
+        num = num / pow28;
+    }
+}
+
+
+/* Read a 32 bit unsigned integer from a buffer big endian order. */
+uint32_t bshuf_read_uint32_BE(void* buf) {
+    uint8_t* b = buf;
+    uint32_t num = 0, pow28 = 1 << 8, cp = 1;
+    for (int ii = 3; ii >= 0; ii--) {
+        num += b[ii] * cp;
+        cp *= pow28;
+    }
+    return num;
+}
+
+
+/* Wrap an encoder whose output size is data dependent to process an entire
+ * buffer in parallel.
+ *
+ * Each thread encodes a contiguous range of blocks into its own buffer. The
+ * start of each thread's output is then found with a prefix sum over their
+ * sizes and the buffers are copied into place in parallel. Thread 0 encodes
+ * directly into *out*, since its output always starts at 0. No thread ever
+ * waits on another except at the single barrier between the two passes.
+ *
+ * *block_bound* bounds the number of bytes the encoder writes for a full block.
+ * *opts* is passed to the encoder in its workspace. With *opts->stride* the
+ * elements of each block are gathered into the workspace of the thread
+ * encoding it, just before, instead of the whole input beforehand.
+ */
+int64_t bshuf_blocked_encode_fun(bshufBlockFunDef fun, void* in, void* out,
+        const size_t size, const size_t elem_size, size_t block_size,
+        const size_t block_bound, const bshuf_opts* opts) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    int64_t err = 0;
+    size_t nblock, last_block_size;
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+    size_t stride = opts->stride ? opts->stride : elem_size;
+    if (stride < elem_size) return -84;
+
+    last_block_size = size % block_size;
+    last_block_size = last_block_size - last_block_size % BSHUF_BLOCKED_MULT;
+    nblock = size / block_size + (last_block_size ? 1 : 0);
+
+    int nthreads = bshuf_max_threads(nblock);
+    bshuf_ws* W = bshuf_ws_alloc(nthreads, block_size * elem_size);
+    if (W == NULL) return -1;
+    bshuf_kernels K = bshuf_kernels_select(elem_size);
+    for (int ii = 0; ii < nthreads; ii ++) {
+        W[ii].opts = *opts;
+        W[ii].kern = K;
+    }
+    // The threads call the selected routines directly.
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    double t_start = bshuf_tic(W);
+    // Bytes written by each thread, turned into their output offsets.
+    int64_t* thread_start = calloc(nthreads + 1, sizeof(int64_t));
+    if (thread_start == NULL) {
+        bshuf_ws_free(W);
+        return -1;
+    }
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+        int nt = 1, tid = bshuf_thread_num();
+#ifdef _OPENMP
+        nt = omp_get_num_threads();
+#endif
+        size_t b0 = nblock * tid / nt, b1 = nblock * (tid + 1) / nt;
+        char* buf = out_b;
+        if (tid && b1 > b0) buf = malloc((b1 - b0) * block_bound);
+        int64_t count = 0, pos = 0;
+        if (buf == NULL) count = -1;
+
+        double t = bshuf_tic(&W[tid]);
+        for (size_t ii = b0; ii < b1 && count >= 0; ii ++) {
+            size_t this_size = ii < size / block_size ? block_size
+                    : last_block_size;
+            char* block_in = in_b + ii * block_size * stride;
+            if (stride != elem_size) {
+                double tg = bshuf_tic(&W[tid]);
+                bshuf_gather(block_in, W[tid].gather, this_size, elem_size,
+                        stride);
+                bshuf_toc(&W[tid], &W[tid].stats.copy, tg);
+                block_in = W[tid].gather;
+            }
+            count = fun(&W[tid], block_in, buf + pos, this_size, elem_size);
+            if (count >= 0 && opts->checksums != NULL) {
+                opts->checksums[ii] = bshuf_crc32c_sel(0, buf + pos, count);
+            }
+            pos += count;
+            W[tid].stats.blocks ++;
+        }
+        bshuf_toc(&W[tid], &W[tid].stats.busy, t);
+        if (count < 0) err = count;
+        thread_start[tid + 1] = pos;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (int ii = 0; ii < nt; ii ++) {
+                thread_start[ii + 1] += thread_start[ii];
+            }
+            // Fewer threads than asked for may have been started.
+            nthreads = nt;
+        }
+
+        if (tid && buf != NULL && b1 > b0) {
+            t = bshuf_tic(&W[tid]);
+            if (err == 0) memcpy(out_b + thread_start[tid], buf, pos);
+            free(buf);
+            bshuf_toc(&W[tid], &W[tid].stats.copy, t);
+            bshuf_toc(&W[tid], &W[tid].stats.busy, t);
+        }
+    }
+    double t_region = bshuf_tic(W) - t_start;
+
+    int64_t cum_count = thread_start[nthreads];
+    free(thread_start);
+
+    size_t leftover_bytes = size % BSHUF_BLOCKED_MULT * elem_size;
+    if (err == 0) {
+        double t = bshuf_tic(W);
+        char* leftover = in_b + (size - size % BSHUF_BLOCKED_MULT) * stride;
+        if (stride != elem_size) {
+            bshuf_gather(leftover, W[0].gather, size % BSHUF_BLOCKED_MULT,
+                    elem_size, stride);
+            leftover = W[0].gather;
+        }
+        err = bshuf_copy_swap(leftover, out_b + cum_count,
+                size % BSHUF_BLOCKED_MULT, elem_size, opts->swap_size);
+        bshuf_toc(W, &W->stats.copy, t);
+    }
+    if (err >= 0 && leftover_bytes && opts->checksums != NULL) {
+        // The elements not fitting into any block end the last chunk, after
+        // the partial block if there is one.
+        size_t last = (size + block_size - 1) / block_size - 1;
+        uint32_t crc = last < nblock ? opts->checksums[last] : 0;
+        opts->checksums[last] = bshuf_crc32c(crc, out_b + cum_count,
+                leftover_bytes);
+    }
+    if (err >= 0) {
+        bshuf_stats_add(W, nthreads, t_start, t_region, size * elem_size,
+                cum_count + leftover_bytes);
+    }
+    bshuf_ws_free(W);
+    if (err < 0) return err;
+
+    return cum_count + leftover_bytes;
+}
+
+
+/* Wrap a decoder whose input size is data dependent to process an entire
+ * buffer in parallel.
+ *
+ * *offsets* locates the chunks in the input, see
+ * *bshuf_lz4_chunk_offsets*. With the input location of every block known all
+ * blocks are decoded independently. If *offsets* is NULL the block headers are
+ * walked first to find them, never past the *in_size* bytes of the input.
+ *
+ * With *opts->checksums* every chunk is checked before it is decoded, by the
+ * thread decoding it. With them or *opts->safe* the offsets are checked to
+ * be in order and within the input, and the block headers to stay within
+ * their chunk, so a corrupt index or header never leads out of the input.
+ */
+int64_t bshuf_blocked_decode_fun(bshufBlockFunDef fun, void* in,
+        const size_t in_size, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const uint64_t* offsets,
+        const bshuf_opts* opts) {
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+    int64_t err = 0, nchunk, count;
+    size_t nblock, last_block_size;
+    uint64_t* offsets_buf = NULL;
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+
+    last_block_size = size % block_size;
+    last_block_size = last_block_size - last_block_size % BSHUF_BLOCKED_MULT;
+    nblock = size / block_size + (last_block_size ? 1 : 0);
+    nchunk = bshuf_lz4_nchunk(size, elem_size, block_size);
+    size_t leftover_bytes = size % BSHUF_BLOCKED_MULT * elem_size;
+
+    if (offsets == NULL) {
+        offsets_buf = malloc((nchunk + 1) * sizeof(uint64_t));
+        if (offsets_buf == NULL) return -1;
+        count = bshuf_lz4_chunk_offsets(in, in_size, offsets_buf, size,
+                elem_size, block_size);
+        if (count < 0) {
+            free(offsets_buf);
+            return count;
+        }
+        offsets = offsets_buf;
+    }
+    int safe = opts->safe || opts->checksums != NULL;
+    if (safe) {
+        for (int64_t ii = 0; ii < nchunk; ii ++) {
+            if (offsets[ii] > offsets[ii + 1]) err = -91;
+        }
+        // The elements after the last block end the last chunk.
+        if (offsets[nchunk] > in_size || (nchunk > 0
+                    && offsets[nchunk] - offsets[nchunk - 1] < leftover_bytes))
+            err = -91;
+        if (err < 0) {
+            free(offsets_buf);
+            return err;
+        }
+    }
+    // Where the elements not fitting into any block are stored.
+    uint64_t leftover_start = offsets[nchunk] - leftover_bytes;
+
+    int nthreads = bshuf_max_threads(nblock);
+    bshuf_ws* W = bshuf_ws_alloc(nthreads, block_size * elem_size);
+    if (W == NULL) {
+        free(offsets_buf);
+        return -1;
+    }
+    bshuf_kernels K = bshuf_kernels_select(elem_size);
+    for (int ii = 0; ii < nthreads; ii ++) {
+        W[ii].opts = *opts;
+        W[ii].kern = K;
+    }
+    // The threads call the selected routines directly.
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    double t_start = bshuf_tic(W);
+
+    #pragma omp parallel for num_threads(nthreads) private(count)
+    for (size_t ii = 0; ii < nblock; ii ++) {
+        size_t this_size = ii < size / block_size ? block_size
+                : last_block_size;
+        uint64_t end = ii + 1 < nblock ? offsets[ii + 1] : leftover_start;
+        bshuf_ws* w = &W[bshuf_thread_num()];
+        double t = bshuf_tic(w);
+        if (opts->checksums != NULL && opts->checksums[ii]
+                != bshuf_crc32c_sel(0, in_b + offsets[ii],
+                    offsets[ii + 1] - offsets[ii])) {
+            count = -92;
+        } else if (safe && (end - offsets[ii] < 4
+                    || bshuf_read_uint32_BE(in_b + offsets[ii])
+                    > end - offsets[ii] - 4)) {
+            count = -91;
+        } else {
+            count = fun(w, in_b + offsets[ii],
+                    out_b + ii * block_size * elem_size, this_size, elem_size);
+        }
+        bshuf_toc(w, &w->stats.busy, t);
+        w->stats.blocks ++;
+        // Bytes after the block up to the next chunk are left unused.
+        if (count >= 0 && (uint64_t) count > end - offsets[ii]) count = -91;
+        if (count < 0) err = count;
+    }
+    double t_region = bshuf_tic(W) - t_start;
+
+    // Elements stored uncompressed after the last block, in a chunk of their
+    // own.
+    if (err == 0 && opts->checksums != NULL && (size_t) nchunk > nblock
+            && opts->checksums[nblock] != bshuf_crc32c(0,
+                in_b + offsets[nblock], offsets[nchunk] - offsets[nblock])) {
+        err = -92;
+    }
+    if (err < 0) {
+        bshuf_ws_free(W);
+        free(offsets_buf);
+        return err;
+    }
+
+    double t = bshuf_tic(W);
+    memcpy(out_b + size * elem_size - leftover_bytes, in_b + leftover_start,
+            leftover_bytes);
+    bshuf_toc(W, &W->stats.copy, t);
+    count = offsets[nchunk] - offsets[0];
+    free(offsets_buf);
+    bshuf_stats_add(W, nthreads, t_start, t_region, count, size * elem_size);
+    bshuf_ws_free(W);
+
+    return count;
+}
+
+
+/* Bitshuffle a block from *in* into *out* with the kernels of W, going
+ * through *tmp*, reversing the bytes of the elements in groups of
+ * *swap_size* on the way, see *bshuf_trans_bit_elem_swap*. */
+int64_t bshuf_ws_trans_bit_elem(bshuf_ws* W, void* in, void* out, void* tmp,
+        const size_t size, const size_t elem_size, const size_t swap_size) {
+
+    int64_t count;
+
+    CHECK_MULT_EIGHT(size);
+
+    count = W->kern.trans_byte_elem(in, out, size, elem_size);
+    CHECK_ERR(count);
+    count = W->kern.trans_bit_byte(out, tmp, size, elem_size);
+    CHECK_ERR(count);
+    return bshuf_trans_bitrow_eight_swap(tmp, out, size, elem_size,
+            swap_size);
+}
+
+
+/* Bitunshuffle a block from *in* into *out* with the kernels of W, going
+ * through *tmp*. */
+int64_t bshuf_ws_untrans_bit_elem(bshuf_ws* W, void* in, void* out,
+        void* tmp, const size_t size, const size_t elem_size) {
+
+    int64_t count;
+
+    CHECK_MULT_EIGHT(size);
+
+    count = W->kern.trans_byte_bitrow(in, tmp, size, elem_size);
+    CHECK_ERR(count);
+    return W->kern.shuffle_bit_eightelem(tmp, out, size, elem_size);
+}
+
+
+/* Bitshuffle a single block. */
+int64_t bshuf_bitshuffle_block(bshuf_ws* W, void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    double t = bshuf_tic(W);
+    int64_t count = bshuf_ws_trans_bit_elem(W, in, out, W->buf, size,
+            elem_size, W->opts.swap_size);
+    bshuf_toc(W, &W->stats.shuffle, t);
+
+    return count;
+}
+
+
+/* Bitunshuffle a single block. */
+int64_t bshuf_bitunshuffle_block(bshuf_ws* W, void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    double t = bshuf_tic(W);
+    int64_t count = bshuf_ws_untrans_bit_elem(W, in, out, W->buf, size,
+            elem_size);
+    bshuf_toc(W, &W->stats.shuffle, t);
+
+    return count;
+}
+
+
+/* Write a 64 bit unsigned integer to a buffer in big endian order. */
+void bshuf_write_uint64_BE(void* buf, uint64_t num) {
     uint8_t* b = buf;
     uint64_t pow28 = 1 << 8;
     for (int ii = 7; ii >= 0; ii--) {
@@ -1203,116 +3245,145 @@ uint64_t bshuf_read_uint64_BE(void* buf) {
 }
 
 
-/* Write a 32 bit unsigned integer to a buffer in big endian order. */
-void bshuf_write_uint32_BE(void* buf, uint32_t num) {
-    uint8_t* b = buf;
-    uint32_t pow28 = 1 << 8;
-    for (int ii = 3; ii >= 0; ii--) {
-        b[ii] = num % pow28;
-        num = num / pow28;
+/* Bitshuffle a block into W->buf for an encoder, byte swapped and filtered
+ * first as W->opts asks. The filter writes to W->gather, where the block
+ * may already be if it was gathered. */
+int64_t bshuf_encode_shuffle(bshuf_ws* W, void* in, const size_t size,
+        const size_t elem_size) {
+
+    // W->buf_lz4 only gets the compressed block afterwards.
+    if (W->opts.filter == BSHUF_FILTER_NONE) {
+        return bshuf_ws_trans_bit_elem(W, in, W->buf, W->buf_lz4, size,
+                elem_size, W->opts.swap_size);
     }
+    int64_t count = bshuf_filter_encode(in, W->gather, size, elem_size,
+            &W->opts);
+    CHECK_ERR(count);
+    return bshuf_ws_trans_bit_elem(W, W->gather, W->buf, W->buf_lz4, size,
+            elem_size, 0);
 }
 
 
-/* Read a 32 bit unsigned integer from a buffer big endian order. */
-uint32_t bshuf_read_uint32_BE(void* buf) {
-    uint8_t* b = buf;
-    uint32_t num = 0, pow28 = 1 << 8, cp = 1;
-    for (int ii = 3; ii >= 0; ii--) {
-        num += b[ii] * cp;
-        cp *= pow28;
+/* Undo *bshuf_encode_shuffle* of a block from W->buf into *out*. */
+int64_t bshuf_decode_unshuffle(bshuf_ws* W, void* out, const size_t size,
+        const size_t elem_size) {
+
+    // Decoders gather nothing.
+    int64_t count = bshuf_ws_untrans_bit_elem(W, W->buf, out, W->gather,
+            size, elem_size);
+    CHECK_ERR(count);
+    if (W->opts.filter != BSHUF_FILTER_NONE) {
+        count = bshuf_filter_decode(out, size, elem_size, &W->opts);
     }
-    return num;
+    return count;
 }
 
 
 /* Bitshuffle and compress a single block. */
-int64_t bshuf_compress_lz4_block(ioc_chain *C_ptr,
+int64_t bshuf_compress_lz4_block(bshuf_ws* W, void* in, void* out,
         const size_t size, const size_t elem_size) {
 
     int64_t nbytes, count;
 
-    void* tmp_buf_bshuf = malloc(size * elem_size);
-    if (tmp_buf_bshuf == NULL) return -1;
-
-    void* tmp_buf_lz4 = malloc(LZ4_compressBound(size * elem_size));
-    if (tmp_buf_lz4 == NULL){
-        free(tmp_buf_bshuf);
-        return -1;
-    }
-
-    size_t this_iter;
-
-    void *in = ioc_get_in(C_ptr, &this_iter);
-    ioc_set_next_in(C_ptr, &this_iter, (void*) ((char*) in + size * elem_size));
-
-    count = bshuf_trans_bit_elem(in, tmp_buf_bshuf, size, elem_size);
-    if (count < 0) {
-        free(tmp_buf_lz4);
-        free(tmp_buf_bshuf);
-        return count;
-    }
-    nbytes = LZ4_compress(tmp_buf_bshuf, tmp_buf_lz4, size * elem_size);
-    free(tmp_buf_bshuf);
-    CHECK_ERR_FREE_LZ(nbytes, tmp_buf_lz4);
-
-    void *out = ioc_get_out(C_ptr, &this_iter);
-    ioc_set_next_out(C_ptr, &this_iter, (void *) ((char *) out + nbytes + 4));
+    double t = bshuf_tic(W);
+    count = bshuf_encode_shuffle(W, in, size, elem_size);
+    bshuf_toc(W, &W->stats.shuffle, t);
+    CHECK_ERR(count);
+    t = bshuf_tic(W);
+    nbytes = LZ4_compress_withState(W->lz4_state, W->buf, (char*) out + 4,
+            size * elem_size);
+    bshuf_toc(W, &W->stats.codec, t);
+    if (nbytes <= 0) return -1001;
 
     bshuf_write_uint32_BE(out, nbytes);
-    memcpy((char *) out + 4, tmp_buf_lz4, nbytes);
-
-    free(tmp_buf_lz4);
 
     return nbytes + 4;
 }
 
 
 /* Decompress and bitunshuffle a single block. */
-int64_t bshuf_decompress_lz4_block(ioc_chain *C_ptr,
+int64_t bshuf_decompress_lz4_block(bshuf_ws* W, void* in, void* out,
         const size_t size, const size_t elem_size) {
 
     int64_t nbytes, count;
 
-    size_t this_iter;
-    void *in = ioc_get_in(C_ptr, &this_iter);
     int32_t nbytes_from_header = bshuf_read_uint32_BE(in);
-    ioc_set_next_in(C_ptr, &this_iter,
-            (void*) ((char*) in + nbytes_from_header + 4));
-
-    void *out = ioc_get_out(C_ptr, &this_iter);
-    ioc_set_next_out(C_ptr, &this_iter,
-            (void *) ((char *) out + size * elem_size));
-
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
 
+    double t = bshuf_tic(W);
 #ifdef BSHUF_LZ4_DECOMPRESS_FAST
-    nbytes = LZ4_decompress_fast((char*) in + 4, tmp_buf, size * elem_size);
-    CHECK_ERR_FREE_LZ(nbytes, tmp_buf);
-    if (nbytes != nbytes_from_header) {
-        free(tmp_buf);
-        return -91;
-    }
-#else
-    nbytes = LZ4_decompress_safe((char*) in + 4, tmp_buf, nbytes_from_header,
-                                 size * elem_size);
-    CHECK_ERR_FREE_LZ(nbytes, tmp_buf);
-    if (nbytes != size * elem_size) {
-        free(tmp_buf);
-        return -91;
-    }
-    nbytes = nbytes_from_header;
+    if (!W->opts.safe) {
+        nbytes = LZ4_decompress_fast((char*) in + 4, W->buf,
+                size * elem_size);
+        CHECK_ERR_LZ(nbytes);
+        if (nbytes != nbytes_from_header) return -91;
+    } else
 #endif
-    count = bshuf_untrans_bit_elem(tmp_buf, out, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    {
+        nbytes = LZ4_decompress_safe((char*) in + 4, W->buf,
+                nbytes_from_header, size * elem_size);
+        CHECK_ERR_LZ(nbytes);
+        if (nbytes != size * elem_size) return -91;
+        nbytes = nbytes_from_header;
+    }
+    bshuf_toc(W, &W->stats.codec, t);
+    t = bshuf_tic(W);
+    count = bshuf_decode_unshuffle(W, out, size, elem_size);
+    bshuf_toc(W, &W->stats.shuffle, t);
+    CHECK_ERR(count);
     nbytes += 4;
 
-    free(tmp_buf);
     return nbytes;
 }
 
 
+/* Bitshuffle and compress a single block with zlib. */
+int64_t bshuf_compress_zlib_block(bshuf_ws* W, void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    int64_t count;
+    int err;
+    uLongf nbytes = compressBound(size * elem_size);
+
+    double t = bshuf_tic(W);
+    count = bshuf_encode_shuffle(W, in, size, elem_size);
+    bshuf_toc(W, &W->stats.shuffle, t);
+    CHECK_ERR(count);
+    t = bshuf_tic(W);
+    err = compress2((Bytef*) out + 4, &nbytes, W->buf, size * elem_size,
+            W->opts.level);
+    bshuf_toc(W, &W->stats.codec, t);
+    if (err != Z_OK) return err - 1000;
+
+    bshuf_write_uint32_BE(out, nbytes);
+
+    return nbytes + 4;
+}
+
+
+/* Decompress with zlib and bitunshuffle a single block. */
+int64_t bshuf_decompress_zlib_block(bshuf_ws* W, void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    int64_t count;
+    int err;
+    uLongf nbytes = size * elem_size;
+
+    uint32_t nbytes_from_header = bshuf_read_uint32_BE(in);
+
+    double t = bshuf_tic(W);
+    err = uncompress(W->buf, &nbytes, (Bytef*) in + 4, nbytes_from_header);
+    bshuf_toc(W, &W->stats.codec, t);
+    if (err != Z_OK) return err - 1000;
+    if (nbytes != size * elem_size) return -91;
+    t = bshuf_tic(W);
+    count = bshuf_decode_unshuffle(W, out, size, elem_size);
+    bshuf_toc(W, &W->stats.shuffle, t);
+    CHECK_ERR(count);
+
+    return nbytes_from_header + 4;
+}
+
+
 /* ---- Public functions ----
  *
  * See header file for description and usage.
@@ -1330,6 +3401,25 @@ size_t bshuf_default_block_size(const size_t elem_size) {
 }
 
 
+int bshuf_stats_enable(int enable) {
+    int old = bshuf_stats_on;
+    bshuf_stats_on = enable != 0;
+    return old;
+}
+
+
+void bshuf_stats_get(bshuf_stats* stats) {
+    #pragma omp critical (bshuf_stats)
+    *stats = bshuf_stats_total;
+}
+
+
+void bshuf_stats_reset(void) {
+    #pragma omp critical (bshuf_stats)
+    memset(&bshuf_stats_total, 0, sizeof(bshuf_stats));
+}
+
+
 size_t bshuf_compress_lz4_bound(const size_t size,
         const size_t elem_size, size_t block_size) {
 
@@ -1339,6 +3429,7 @@ size_t bshuf_compress_lz4_bound(const size_t size,
         block_size = bshuf_default_block_size(elem_size);
     }
     if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+    if (block_size * elem_size > BSHUF_MAX_BLOCK_BYTES) return -83;
 
     // Note that each block gets a 4 byte header.
     // Size of full blocks.
@@ -1356,7 +3447,16 @@ int64_t bshuf_bitshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
 
     return bshuf_blocked_wrap_fun(&bshuf_bitshuffle_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, &bshuf_opts_none);
+}
+
+
+int64_t bshuf_bitshuffle_swap(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t swap_size) {
+
+    bshuf_opts opts = {0, swap_size};
+    return bshuf_blocked_wrap_fun(&bshuf_bitshuffle_block, in, out, size,
+            elem_size, block_size, &opts);
 }
 
 
@@ -1364,21 +3464,245 @@ int64_t bshuf_bitunshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
 
     return bshuf_blocked_wrap_fun(&bshuf_bitunshuffle_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, &bshuf_opts_none);
 }
 
 
 int64_t bshuf_compress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
-    return bshuf_blocked_wrap_fun(&bshuf_compress_lz4_block, in, out, size,
-            elem_size, block_size);
+
+    return bshuf_compress_lz4_swap(in, out, size, elem_size, block_size, 0);
+}
+
+
+int64_t bshuf_compress_lz4_swap(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t swap_size) {
+
+    return bshuf_compress_lz4_checked(in, out, size, elem_size, block_size,
+            swap_size, NULL);
+}
+
+
+int64_t bshuf_compress_lz4_checked(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t swap_size,
+        uint32_t* checksums) {
+
+    return bshuf_compress_lz4_strided(in, out, size, elem_size, block_size,
+            0, swap_size, checksums);
+}
+
+
+int64_t bshuf_compress_lz4_strided(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t stride,
+        const size_t swap_size, uint32_t* checksums) {
+
+    bshuf_opts opts = {0, swap_size, checksums, 0, stride};
+    return bshuf_compress_lz4_opts(in, out, size, elem_size, block_size,
+            &opts);
+}
+
+
+int64_t bshuf_compress_lz4_opts(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const bshuf_opts* opts) {
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size * elem_size > BSHUF_MAX_BLOCK_BYTES) return -83;
+    return bshuf_blocked_encode_fun(&bshuf_compress_lz4_block, in, out, size,
+            elem_size, block_size,
+            LZ4_compressBound(block_size * elem_size) + 4, opts);
 }
 
 
 int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
-    return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
-            elem_size, block_size);
+    return bshuf_blocked_decode_fun(&bshuf_decompress_lz4_block, in, SIZE_MAX,
+            out, size, elem_size, block_size, NULL, &bshuf_opts_none);
+}
+
+
+int64_t bshuf_decompress_lz4_offsets(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const uint64_t* offsets) {
+    return bshuf_blocked_decode_fun(&bshuf_decompress_lz4_block, in, SIZE_MAX,
+            out, size, elem_size, block_size, offsets, &bshuf_opts_none);
+}
+
+
+int64_t bshuf_decompress_lz4_checked(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets,
+        const uint32_t* checksums) {
+    // Only read by the decoder.
+    bshuf_opts opts = {0, 0, (uint32_t*) checksums, checksums != NULL};
+    return bshuf_decompress_lz4_opts(in, in_size, out, size, elem_size,
+            block_size, offsets, &opts);
+}
+
+
+int64_t bshuf_decompress_lz4_opts(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets, const bshuf_opts* opts) {
+    return bshuf_blocked_decode_fun(&bshuf_decompress_lz4_block, in, in_size,
+            out, size, elem_size, block_size, offsets, opts);
+}
+
+
+size_t bshuf_compress_zlib_bound(const size_t size,
+        const size_t elem_size, size_t block_size) {
+
+    size_t bound, leftover;
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
+    if (block_size * elem_size > BSHUF_MAX_BLOCK_BYTES) return -83;
+
+    bound = (compressBound(block_size * elem_size) + 4) * (size / block_size);
+    leftover = ((size % block_size) / BSHUF_BLOCKED_MULT) * BSHUF_BLOCKED_MULT;
+    if (leftover) bound += compressBound(leftover * elem_size) + 4;
+    bound += (size % BSHUF_BLOCKED_MULT) * elem_size;
+    return bound;
+}
+
+
+int64_t bshuf_compress_zlib(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int level,
+        const size_t swap_size) {
+
+    return bshuf_compress_zlib_checked(in, out, size, elem_size, block_size,
+            level, swap_size, NULL);
+}
+
+
+int64_t bshuf_compress_zlib_checked(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int level,
+        const size_t swap_size, uint32_t* checksums) {
+
+    return bshuf_compress_zlib_strided(in, out, size, elem_size, block_size,
+            level, 0, swap_size, checksums);
+}
+
+
+int64_t bshuf_compress_zlib_strided(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int level,
+        const size_t stride, const size_t swap_size, uint32_t* checksums) {
+
+    bshuf_opts opts = {level, swap_size, checksums, 0, stride};
+    return bshuf_compress_zlib_opts(in, out, size, elem_size, block_size,
+            &opts);
+}
+
+
+int64_t bshuf_compress_zlib_opts(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const bshuf_opts* opts) {
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size * elem_size > BSHUF_MAX_BLOCK_BYTES) return -83;
+    return bshuf_blocked_encode_fun(&bshuf_compress_zlib_block, in, out,
+            size, elem_size, block_size,
+            compressBound(block_size * elem_size) + 4, opts);
+}
+
+
+int64_t bshuf_decompress_zlib(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size) {
+    return bshuf_blocked_decode_fun(&bshuf_decompress_zlib_block, in,
+            SIZE_MAX, out, size, elem_size, block_size, NULL,
+            &bshuf_opts_none);
+}
+
+
+int64_t bshuf_decompress_zlib_offsets(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const uint64_t* offsets) {
+    return bshuf_blocked_decode_fun(&bshuf_decompress_zlib_block, in,
+            SIZE_MAX, out, size, elem_size, block_size, offsets,
+            &bshuf_opts_none);
+}
+
+
+int64_t bshuf_decompress_zlib_checked(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets,
+        const uint32_t* checksums) {
+    // Only read by the decoder; zlib always checks its input.
+    bshuf_opts opts = {0, 0, (uint32_t*) checksums, checksums != NULL};
+    return bshuf_decompress_zlib_opts(in, in_size, out, size, elem_size,
+            block_size, offsets, &opts);
+}
+
+
+int64_t bshuf_decompress_zlib_opts(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets, const bshuf_opts* opts) {
+    return bshuf_blocked_decode_fun(&bshuf_decompress_zlib_block, in,
+            in_size, out, size, elem_size, block_size, offsets, opts);
+}
+
+
+int64_t bshuf_crc32c_chunks(void* in, const uint64_t* offsets,
+        const size_t nchunk, uint32_t* checksums) {
+
+    char* in_b = (char*) in;
+
+    if (bshuf_isa < 0) bshuf_select_isa(-1);
+    int nthreads = bshuf_max_threads(nchunk);
+    #pragma omp parallel for num_threads(nthreads)
+    for (size_t ii = 0; ii < nchunk; ii ++) {
+        checksums[ii] = bshuf_crc32c_sel(0, in_b + offsets[ii],
+                offsets[ii + 1] - offsets[ii]);
+    }
+    return nchunk;
+}
+
+
+int64_t bshuf_lz4_nchunk(const size_t size, const size_t elem_size,
+        size_t block_size) {
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size % BSHUF_BLOCKED_MULT) return -81;
+
+    return (size + block_size - 1) / block_size;
+}
+
+
+int64_t bshuf_lz4_chunk_offsets(void* in, const size_t in_size,
+        uint64_t* offsets, const size_t size, const size_t elem_size,
+        size_t block_size) {
+
+    char* in_b = (char*) in;
+    size_t pos = 0, nblock;
+
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    if (block_size % BSHUF_BLOCKED_MULT) return -81;
+
+    // Blocks with a header: all full blocks and the partial block, if any.
+    nblock = size / block_size;
+    if ((size % block_size) / BSHUF_BLOCKED_MULT) nblock ++;
+
+    for (size_t ii = 0; ii < nblock; ii ++) {
+        offsets[ii] = pos;
+        if (pos + 4 > in_size) return -91;
+        pos += bshuf_read_uint32_BE(&in_b[pos]) + 4;
+    }
+    // Elements stored uncompressed form a chunk of their own if there is no
+    // partial block.
+    if (nblock * block_size < size && nblock == size / block_size) {
+        offsets[nblock] = pos;
+        nblock ++;
+    }
+    pos += (size % BSHUF_BLOCKED_MULT) * elem_size;
+    if (pos > in_size) return -91;
+    offsets[nblock] = pos;
+
+    return nblock;
 }
 
 
@@ -1390,6 +3714,13 @@ int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
 #undef CHECK_ERR
 #undef CHECK_ERR_FREE
 #undef CHECK_ERR_FREE_LZ
+#undef CHECK_ERR_LZ
+#undef BSHUF_ALIGN_UP
 
 #undef USESSE2
 #undef USEAVX2
+#undef USEAVX512
+#undef USENEON
+#undef BSHUF_TARGET_SSE2
+#undef BSHUF_TARGET_AVX2
+#undef BSHUF_TARGET_AVX512
@@ -12,15 +12,23 @@
  * Header File
  *
  * Worker routines return an int64_t which is the number of bytes processed
- * if positive or an error code if negative.
+ * if positive or an error code if negative. Sizes are size_t throughout; only
+ * a single block is limited, to about 2 GB.
  *
  * Error codes:
  *      -1    : Failed to allocate memory.
  *      -11   : Missing SSE.
  *      -12   : Missing AVX.
+ *      -13   : Missing AVX-512.
+ *      -14   : Missing NEON.
  *      -80   : Input size not a multiple of 8.
  *      -81   : block_size not multiple of 8.
+ *      -82   : elem_size not a multiple of swap_size.
+ *      -83   : block_size * elem_size too large for the compressor.
+ *      -84   : Input stride shorter than elem_size.
+ *      -85   : Filter unknown, or not for elements of elem_size.
  *      -91   : Decompression error, wrong number of bytes processed.
+ *      -92   : Checksum mismatch, the compressed data is corrupt.
  *      -1YYY : Error internal to compression routine with error code -YYY.
  */
 
@@ -41,9 +49,64 @@
 #endif
 
 
+// Instruction sets for *bshuf_select_isa*. Where several are available the
+// highest is preferred.
+#define BSHUF_ISA_SCAL 0
+#define BSHUF_ISA_SSE2 1
+#define BSHUF_ISA_AVX2 2
+#define BSHUF_ISA_AVX512 3
+#define BSHUF_ISA_NEON 4
+
+
+// Filters of the numbers of each block, see *bshuf_opts*.
+#define BSHUF_FILTER_NONE 0
+#define BSHUF_FILTER_DELTA 1
+#define BSHUF_FILTER_XOR 2
+
+
+/* ---- bshuf_opts ----
+ *
+ * Options of the *_opts* routines, each the union of those of the routines
+ * before it.
+ *
+ * Fields
+ * ------
+ *  level : zlib compression level, for *bshuf_compress_zlib_opts*.
+ *  swap_size : byte swap the input first, see *bshuf_bitshuffle_swap*.
+ *  checksums : CRC32C of each chunk, stored by the encoders and verified by
+ *  the decoders, see *bshuf_compress_lz4_checked*; NULL for none.
+ *  safe : decoders never trust the block headers.
+ *  stride : bytes from one input element to the next, see
+ *  *bshuf_compress_lz4_strided*; 0 for contiguous input.
+ *  filter : BSHUF_FILTER_DELTA stores each number of a block as the
+ *  difference to the one *filter_distance* before it, in wrapping integer
+ *  arithmetic, and BSHUF_FILTER_XOR as the exclusive or with it, for floats.
+ *  Smooth images and sorted columns then have zeros in their high bits,
+ *  which bitshuffle compresses well. The first *filter_distance* numbers of
+ *  each block are stored as they are, so blocks still decompress on their
+ *  own; so are the fewer than 8 elements after the last block. For elements
+ *  of 1, 2, 4 or 8 bytes.
+ *  filter_distance : elements back the filter looks, 1 for the previous
+ *  element, the length of a row for the pixel above in an image; 0 is 1.
+ *  filter_swap : whether the numbers are stored in the other byte order than
+ *  the machine's; the filters work on their values.
+ *
+ */
+typedef struct bshuf_opts {
+    int level;
+    size_t swap_size;
+    uint32_t* checksums;
+    int safe;
+    size_t stride;
+    int filter;
+    size_t filter_distance;
+    int filter_swap;
+} bshuf_opts;
+
+
 /* --- bshuf_using_SSE2 ----
  *
- * Whether routines where compiled with the SSE2 instruction set.
+ * Whether the selected routines use the SSE2 instruction set.
  *
  * Returns
  * -------
@@ -55,7 +118,7 @@ int bshuf_using_SSE2(void);
 
 /* ---- bshuf_using_AVX2 ----
  *
- * Whether routines where compiled with the AVX2 instruction set.
+ * Whether the selected routines use the AVX2 instruction set.
  *
  * Returns
  * -------
@@ -65,6 +128,131 @@ int bshuf_using_SSE2(void);
 int bshuf_using_AVX2(void);
 
 
+/* ---- bshuf_using_AVX512 ----
+ *
+ * Whether the selected routines use the AVX-512BW instruction set.
+ *
+ * Returns
+ * -------
+ *  1 if using AVX-512BW, 0 otherwise.
+ *
+ */
+int bshuf_using_AVX512(void);
+
+
+/* ---- bshuf_using_NEON ----
+ *
+ * Whether the selected routines use the ARM NEON instruction set.
+ *
+ * Returns
+ * -------
+ *  1 if using NEON, 0 otherwise.
+ *
+ */
+int bshuf_using_NEON(void);
+
+
+/* ---- bshuf_select_isa ----
+ *
+ * Select the instruction set used by the bitshuffle routines.
+ *
+ * Every variant of the kernels the compiler supports is built and by default
+ * the best one the CPU supports is selected on first use, so a single build
+ * runs at full speed on any machine. Call this to override the choice, for
+ * instance for benchmarking. Not thread safe: call before any of the other
+ * routines run.
+ *
+ * Parameters
+ * ----------
+ *  isa : one of the BSHUF_ISA_* constants, or -1 for the best available.
+ *
+ * Returns
+ * -------
+ *  the selected instruction set, negative error-code if it is not available.
+ *
+ */
+int bshuf_select_isa(int isa);
+
+
+/* ---- bshuf_set_num_threads ----
+ *
+ * Set the number of threads the blocked routines called from this thread
+ * use, for instance to measure how they scale. The default is that of
+ * OpenMP, all cores unless OMP_NUM_THREADS says otherwise.
+ *
+ * Parameters
+ * ----------
+ *  nthreads : number of threads, 0 to only query.
+ *
+ * Returns
+ * -------
+ *  the previous number of threads; always 1 without OpenMP.
+ *
+ */
+int bshuf_set_num_threads(int nthreads);
+
+
+// Threads whose work is counted separately in *bshuf_stats*; higher thread
+// numbers are added to the last.
+#define BSHUF_STATS_MAX_THREADS 64
+
+
+/* Counters of the blocked routines, see *bshuf_stats_get*. Times are in
+ * seconds, those of a step summed over the threads. */
+typedef struct bshuf_stats {
+    uint64_t calls;         // Blocked routines run.
+    uint64_t blocks;        // Blocks processed.
+    uint64_t bytes_in;      // Bytes read by the routines.
+    uint64_t bytes_out;     // Bytes written by the routines.
+    double wall_time;       // Elapsed time of the routines.
+    double shuffle_time;    // In bitshuffle, bitunshuffle and byte swaps.
+    double codec_time;      // In LZ4 and zlib.
+    double copy_time;       // Copying encoded blocks or elements into place.
+    double wait_time;       // Threads waiting for the others to finish.
+    int max_threads;        // Most threads a routine used.
+    uint64_t thread_blocks[BSHUF_STATS_MAX_THREADS];
+    double thread_time[BSHUF_STATS_MAX_THREADS];    // Busy time per thread.
+} bshuf_stats;
+
+
+/* ---- bshuf_stats_enable ----
+ *
+ * Start or stop counting the work of the blocked routines. Off by default;
+ * when off the routines do not read the clock.
+ *
+ * Parameters
+ * ----------
+ *  enable : 1 to count, 0 to stop.
+ *
+ * Returns
+ * -------
+ *  whether counting was on before.
+ *
+ */
+int bshuf_stats_enable(int enable);
+
+
+/* ---- bshuf_stats_get ----
+ *
+ * Copy the counters accumulated since they were last reset, over all
+ * routines run while counting was on, from any thread.
+ *
+ * Parameters
+ * ----------
+ *  stats : the counters are stored here.
+ *
+ */
+void bshuf_stats_get(bshuf_stats* stats);
+
+
+/* ---- bshuf_stats_reset ----
+ *
+ * Set all counters to zero.
+ *
+ */
+void bshuf_stats_reset(void);
+
+
 /* ---- bshuf_default_block_size ----
  *
  * The default block size as function of element size.
@@ -109,6 +297,35 @@ int64_t bshuf_bitshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size);
 
 
+/* ---- bshuf_bitshuffle_swap ----
+ *
+ * Byte swap and bitshuffle the data.
+ *
+ * Same as *bshuf_bitshuffle* of the data with the bytes of each element
+ * reversed in groups of *swap_size*, e.g. big endian numbers stored in native
+ * order. The reversal is fused into the bit transpose and costs no extra pass
+ * over the data. Unshuffling gives the byte swapped data.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer, must be of size * elem_size bytes
+ *  out : output buffer, must be of size * elem_size bytes
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Do transpose in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *  swap_size : bytes reversed as a group: elem_size for numbers, half of it
+ *  for complex numbers; 0 or 1 for no swap.
+ *
+ * Returns
+ * -------
+ *  number of bytes processed, negative error-code if failed.
+ *
+ */
+int64_t bshuf_bitshuffle_swap(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t swap_size);
+
+
 /* ---- bshuf_bitunshuffle ----
  *
  * Unshuffle bitshuffled data.
@@ -187,6 +404,68 @@ int64_t bshuf_compress_lz4(void* in, void* out, const size_t size, const size_t
         elem_size, size_t block_size);
 
 
+/* ---- bshuf_compress_lz4_swap ----
+ *
+ * Byte swap, bitshuffle and compress the data using LZ4.
+ *
+ * Same as *bshuf_compress_lz4* of the data byte swapped in groups of
+ * *swap_size*, see *bshuf_bitshuffle_swap*.
+ *
+ */
+int64_t bshuf_compress_lz4_swap(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t swap_size);
+
+
+/* ---- bshuf_compress_lz4_checked ----
+ *
+ * Same as *bshuf_compress_lz4_swap*, also storing the CRC32C of the
+ * compressed bytes of every chunk, see *bshuf_lz4_nchunk*, for
+ * *bshuf_decompress_lz4_checked*. Each is computed by the thread compressing
+ * the chunk, while it is still in its cache.
+ *
+ * Parameters
+ * ----------
+ *  checksums : output buffer, must hold *bshuf_lz4_nchunk* integers; chunk
+ *  *ii* has *checksums[ii]* = *bshuf_crc32c(0, in + offsets[ii],
+ *  offsets[ii + 1] - offsets[ii])* with the offsets of
+ *  *bshuf_lz4_chunk_offsets*.
+ *
+ */
+int64_t bshuf_compress_lz4_checked(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t swap_size,
+        uint32_t* checksums);
+
+
+/* ---- bshuf_compress_lz4_strided ----
+ *
+ * Same as *bshuf_compress_lz4_checked* of elements *stride* bytes apart,
+ * e.g. a field of an array of records or a slice with a step. Each block is
+ * gathered into the scratch space of the thread compressing it, so the input
+ * is never copied whole. The output is that of the elements contiguous.
+ *
+ * Parameters
+ * ----------
+ *  stride : bytes from the start of an element to the next, at least
+ *  *elem_size*; 0 for *elem_size*.
+ *  checksums : output buffer, see *bshuf_compress_lz4_checked*, or NULL.
+ *
+ */
+int64_t bshuf_compress_lz4_strided(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const size_t stride,
+        const size_t swap_size, uint32_t* checksums);
+
+
+/* ---- bshuf_compress_lz4_opts ----
+ *
+ * Same as *bshuf_compress_lz4* with the options of *opts*, see *bshuf_opts*;
+ * *bshuf_decompress_lz4_opts* with the same filter options decompresses the
+ * output.
+ *
+ */
+int64_t bshuf_compress_lz4_opts(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const bshuf_opts* opts);
+
+
 /* ---- bshuf_decompress_lz4 ----
  *
  * Undo compression and bitshuffling.
@@ -219,4 +498,305 @@ int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size);
 
 
+/* ---- bshuf_decompress_lz4_offsets ----
+ *
+ * Undo compression and bitshuffling, given the location of the chunks.
+ *
+ * Same as *bshuf_decompress_lz4* but the location of every block in the input
+ * is taken from *offsets*, as filled by *bshuf_lz4_chunk_offsets*, instead
+ * of being found by walking the block headers. All blocks are then
+ * decompressed independently and the input is only touched by the threads
+ * decompressing it.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer
+ *  out : output buffer, must be of size * elem_size bytes
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *  offsets : *bshuf_lz4_nchunk* + 1 chunk offsets into *in*, the first of
+ *  which must be 0. The bytes of a chunk after its block, if any, are not
+ *  read; chunks rewritten elsewhere leave them behind.
+ *
+ * Returns
+ * -------
+ *  number of bytes consumed in *input* buffer, negative error-code if failed.
+ *
+ */
+int64_t bshuf_decompress_lz4_offsets(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const uint64_t* offsets);
+
+
+/* ---- bshuf_decompress_lz4_checked ----
+ *
+ * Same as *bshuf_decompress_lz4_offsets*, verifying the chunks first.
+ *
+ * Every chunk is checked against its CRC32C from
+ * *bshuf_compress_lz4_checked* by the thread decompressing it, just before
+ * it is, and is decompressed with LZ4_decompress_safe, which never leaves
+ * the chunk whatever its contents.
+ *
+ * The offsets are checked to be in order and within the *in_size* bytes of
+ * the input, and the block headers to stay within their chunk, so neither a
+ * corrupt index nor a corrupt header is followed out of the input.
+ *
+ * Parameters
+ * ----------
+ *  in_size : number of bytes in input buffer
+ *  offsets : chunk offsets as for *bshuf_decompress_lz4_offsets*, or NULL
+ *  to walk the block headers.
+ *  checksums : *bshuf_lz4_nchunk* checksums of the chunks.
+ *
+ * Returns
+ * -------
+ *  number of bytes consumed in *input* buffer, negative error-code if failed,
+ *  -91 if the offsets or a header do not fit the input, -92 if a chunk does
+ *  not match its checksum.
+ *
+ */
+int64_t bshuf_decompress_lz4_checked(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets,
+        const uint32_t* checksums);
+
+
+/* ---- bshuf_decompress_lz4_opts ----
+ *
+ * Same as *bshuf_decompress_lz4_offsets* with the options of *opts*: the
+ * checksums and safe decoding of *bshuf_decompress_lz4_checked*, with
+ * *opts->safe* also without checksums, and the filter of the compressed
+ * data, which is undone after unshuffling.
+ *
+ */
+int64_t bshuf_decompress_lz4_opts(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets, const bshuf_opts* opts);
+
+
+/* ---- bshuf_compress_zlib_bound ----
+ *
+ * Bound on size of data compressed with *bshuf_compress_zlib*.
+ *
+ * Parameters
+ * ----------
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *
+ * Returns
+ * -------
+ *  Bound on compressed data size.
+ *
+ */
+size_t bshuf_compress_zlib_bound(const size_t size,
+        const size_t elem_size, size_t block_size);
+
+
+/* ---- bshuf_compress_zlib ----
+ *
+ * Bitshuffle and compress the data using zlib (deflate).
+ *
+ * Slower than *bshuf_compress_lz4* but compresses better, for data written
+ * once and kept. The layout of the output is the same as for
+ * *bshuf_compress_lz4*: each block is prefixed by a 4 byte integer giving its
+ * compressed size, so *bshuf_lz4_nchunk* and *bshuf_lz4_chunk_offsets* apply
+ * to it as well.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer, must be of size * elem_size bytes
+ *  out : output buffer, must be *bshuf_compress_zlib_bound* bytes.
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *  level : zlib compression level, 1 (fastest) to 9 (best).
+ *  swap_size : byte swap the data first, see *bshuf_bitshuffle_swap*.
+ *
+ * Returns
+ * -------
+ *  number of bytes used in output buffer, negative error-code if failed.
+ *
+ */
+int64_t bshuf_compress_zlib(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int level,
+        const size_t swap_size);
+
+
+/* ---- bshuf_decompress_zlib ----
+ *
+ * Undo *bshuf_compress_zlib*.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer
+ *  out : output buffer, must be of size * elem_size bytes
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Must match value used for compression.
+ *
+ * Returns
+ * -------
+ *  number of bytes consumed in *input* buffer, negative error-code if failed.
+ *
+ */
+int64_t bshuf_decompress_zlib(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size);
+
+
+/* ---- bshuf_decompress_zlib_offsets ----
+ *
+ * Same as *bshuf_decompress_zlib* given the location of the chunks, see
+ * *bshuf_decompress_lz4_offsets*.
+ *
+ */
+int64_t bshuf_decompress_zlib_offsets(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const uint64_t* offsets);
+
+
+/* ---- bshuf_compress_zlib_checked ----
+ *
+ * Same as *bshuf_compress_zlib*, also storing the checksums of the chunks,
+ * see *bshuf_compress_lz4_checked*.
+ *
+ */
+int64_t bshuf_compress_zlib_checked(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int level,
+        const size_t swap_size, uint32_t* checksums);
+
+
+/* ---- bshuf_compress_zlib_strided ----
+ *
+ * Same as *bshuf_compress_zlib_checked* of elements *stride* bytes apart,
+ * see *bshuf_compress_lz4_strided*.
+ *
+ */
+int64_t bshuf_compress_zlib_strided(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const int level,
+        const size_t stride, const size_t swap_size, uint32_t* checksums);
+
+
+/* ---- bshuf_compress_zlib_opts ----
+ *
+ * Same as *bshuf_compress_zlib* with the options of *opts*, the level
+ * among them, see *bshuf_compress_lz4_opts*.
+ *
+ */
+int64_t bshuf_compress_zlib_opts(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, const bshuf_opts* opts);
+
+
+/* ---- bshuf_decompress_zlib_checked ----
+ *
+ * Same as *bshuf_decompress_zlib_offsets*, verifying the chunks first, see
+ * *bshuf_decompress_lz4_checked*.
+ *
+ */
+int64_t bshuf_decompress_zlib_checked(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets,
+        const uint32_t* checksums);
+
+
+/* ---- bshuf_decompress_zlib_opts ----
+ *
+ * Same as *bshuf_decompress_zlib_offsets* with the options of *opts*, see
+ * *bshuf_decompress_lz4_opts*.
+ *
+ */
+int64_t bshuf_decompress_zlib_opts(void* in, const size_t in_size,
+        void* out, const size_t size, const size_t elem_size,
+        size_t block_size, const uint64_t* offsets, const bshuf_opts* opts);
+
+
+/* ---- bshuf_crc32c ----
+ *
+ * CRC32C (Castagnoli) of a buffer, with the crc32 instruction of SSE4.2 or
+ * ARMv8 where the selected instruction set has it.
+ *
+ * Parameters
+ * ----------
+ *  crc : 0, or the CRC of the bytes preceding *buf* to continue it.
+ *  buf : input buffer
+ *  nbytes : number of bytes in *buf*
+ *
+ * Returns
+ * -------
+ *  the CRC of the bytes.
+ *
+ */
+uint32_t bshuf_crc32c(uint32_t crc, const void* buf, const size_t nbytes);
+
+
+/* ---- bshuf_crc32c_chunks ----
+ *
+ * CRC32C of each of *nchunk* chunks of a buffer, in parallel. Chunk *ii* is
+ * the bytes *offsets[ii]* to *offsets[ii + 1]* of *in*.
+ *
+ * Returns
+ * -------
+ *  nchunk.
+ *
+ */
+int64_t bshuf_crc32c_chunks(void* in, const uint64_t* offsets,
+        const size_t nchunk, uint32_t* checksums);
+
+
+/* ---- bshuf_lz4_nchunk ----
+ *
+ * Number of chunks in data compressed with *bshuf_compress_lz4*.
+ *
+ * A chunk holds the compressed data of *block_size* elements. The last chunk
+ * holds the remaining elements: the partial block, if any, followed by the
+ * elements stored uncompressed. A chunk can be decompressed independently of
+ * the others.
+ *
+ * Parameters
+ * ----------
+ *  size : number of elements in input
+ *  elem_size : element size of typed data
+ *  block_size : Process in blocks of this many elements. Pass 0 to
+ *  select automatically (recommended).
+ *
+ * Returns
+ * -------
+ *  number of chunks, negative error-code if failed.
+ *
+ */
+int64_t bshuf_lz4_nchunk(const size_t size, const size_t elem_size,
+        size_t block_size);
+
+
+/* ---- bshuf_lz4_chunk_offsets ----
+ *
+ * Locate the chunks in data compressed with *bshuf_compress_lz4*.
+ *
+ * Walks the 4 byte block headers of the compressed buffer without
+ * decompressing any data. Chunk *ii* starts at byte *offsets[ii]* and ends at
+ * byte *offsets[ii + 1]*. Decompressing the bytes of chunks *ii* to *jj*
+ * with *bshuf_decompress_lz4* yields elements *ii * block_size* to
+ * *min(jj * block_size, size)*.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer, compressed data
+ *  in_size : number of bytes in input buffer
+ *  offsets : output buffer, must hold *bshuf_lz4_nchunk* + 1 integers
+ *  size : number of elements in the uncompressed data
+ *  elem_size : element size of typed data
+ *  block_size : Must match value used for compression.
+ *
+ * Returns
+ * -------
+ *  number of chunks, negative error-code if failed.
+ *
+ */
+int64_t bshuf_lz4_chunk_offsets(void* in, const size_t in_size,
+        uint64_t* offsets, const size_t size, const size_t elem_size,
+        size_t block_size);
+
+
 #endif  // BITSHUFFLE_H
@@ -18,18 +18,109 @@ cdef int REPEATC = 1
 
 REPEAT = REPEATC
 
-cdef extern from "bitshuffle.h":
+cdef extern from "bitshuffle.h" nogil:
     int bshuf_using_SSE2()
     int bshuf_using_AVX2()
-    int bshuf_bitshuffle(void *A, void *B, int size, int elem_size,
-            int block_size)
-    int bshuf_bitunshuffle(void *A, void *B, int size, int elem_size,
-            int block_size)
-    int bshuf_compress_lz4_bound(int size, int elem_size, int block_size)
-    int bshuf_compress_lz4(void *A, void *B, int size, int elem_size,
-            int block_size)
-    int bshuf_decompress_lz4(void *A, void *B, int size, int elem_size,
-            int block_size)
+    int bshuf_using_AVX512()
+    int bshuf_using_NEON()
+    int bshuf_select_isa(int isa)
+    int bshuf_set_num_threads(int nthreads)
+    int BSHUF_STATS_MAX_THREADS
+    ctypedef struct bshuf_stats:
+        np.uint64_t calls
+        np.uint64_t blocks
+        np.uint64_t bytes_in
+        np.uint64_t bytes_out
+        double wall_time
+        double shuffle_time
+        double codec_time
+        double copy_time
+        double wait_time
+        int max_threads
+        # BSHUF_STATS_MAX_THREADS of each
+        np.uint64_t thread_blocks[64]
+        double thread_time[64]
+    int bshuf_stats_enable(int enable)
+    void bshuf_stats_get(bshuf_stats *stats)
+    void bshuf_stats_reset()
+    int BSHUF_ISA_SCAL
+    int BSHUF_ISA_SSE2
+    int BSHUF_ISA_AVX2
+    int BSHUF_ISA_AVX512
+    int BSHUF_ISA_NEON
+    int BSHUF_FILTER_NONE
+    int BSHUF_FILTER_DELTA
+    int BSHUF_FILTER_XOR
+    ctypedef struct bshuf_opts:
+        int level
+        size_t swap_size
+        np.uint32_t* checksums
+        int safe
+        size_t stride
+        int filter
+        size_t filter_distance
+        int filter_swap
+    np.int64_t bshuf_bitshuffle(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size)
+    np.int64_t bshuf_bitshuffle_swap(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, size_t swap_size)
+    np.int64_t bshuf_bitunshuffle(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size)
+    size_t bshuf_compress_lz4_bound(size_t size, size_t elem_size,
+            size_t block_size)
+    np.int64_t bshuf_compress_lz4(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size)
+    np.int64_t bshuf_compress_lz4_swap(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, size_t swap_size)
+    np.int64_t bshuf_compress_lz4_checked(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, size_t swap_size,
+            np.uint32_t *checksums)
+    np.int64_t bshuf_compress_lz4_strided(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, size_t stride,
+            size_t swap_size, np.uint32_t *checksums)
+    np.int64_t bshuf_compress_lz4_opts(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, bshuf_opts *opts)
+    np.int64_t bshuf_decompress_lz4(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size)
+    np.int64_t bshuf_decompress_lz4_offsets(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, np.uint64_t *offsets)
+    np.int64_t bshuf_decompress_lz4_checked(void *A, size_t in_size, void *B,
+            size_t size, size_t elem_size, size_t block_size,
+            np.uint64_t *offsets, np.uint32_t *checksums)
+    np.int64_t bshuf_decompress_lz4_opts(void *A, size_t in_size, void *B,
+            size_t size, size_t elem_size, size_t block_size,
+            np.uint64_t *offsets, bshuf_opts *opts)
+    size_t bshuf_compress_zlib_bound(size_t size, size_t elem_size,
+            size_t block_size)
+    np.int64_t bshuf_compress_zlib(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, int level, size_t swap_size)
+    np.int64_t bshuf_decompress_zlib(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size)
+    np.int64_t bshuf_decompress_zlib_offsets(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, np.uint64_t *offsets)
+    np.int64_t bshuf_compress_zlib_checked(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, int level, size_t swap_size,
+            np.uint32_t *checksums)
+    np.int64_t bshuf_compress_zlib_strided(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, int level, size_t stride,
+            size_t swap_size, np.uint32_t *checksums)
+    np.int64_t bshuf_decompress_zlib_checked(void *A, size_t in_size, void *B,
+            size_t size, size_t elem_size, size_t block_size,
+            np.uint64_t *offsets, np.uint32_t *checksums)
+    np.int64_t bshuf_compress_zlib_opts(void *A, void *B, size_t size,
+            size_t elem_size, size_t block_size, bshuf_opts *opts)
+    np.int64_t bshuf_decompress_zlib_opts(void *A, size_t in_size, void *B,
+            size_t size, size_t elem_size, size_t block_size,
+            np.uint64_t *offsets, bshuf_opts *opts)
+    np.uint32_t bshuf_crc32c(np.uint32_t crc, void *buf, size_t nbytes)
+    np.int64_t bshuf_crc32c_chunks(void *A, np.uint64_t *offsets,
+            size_t nchunk, np.uint32_t *checksums)
+    size_t bshuf_default_block_size(size_t elem_size)
+    np.int64_t bshuf_lz4_nchunk(size_t size, size_t elem_size,
+            size_t block_size)
+    np.int64_t bshuf_lz4_chunk_offsets(void *A, size_t in_size,
+            np.uint64_t *offsets, size_t size, size_t elem_size,
+            size_t block_size)
     int BSHUF_VERSION_MAJOR
     int BSHUF_VERSION_MINOR
     int BSHUF_VERSION_POINT
@@ -40,34 +131,43 @@ __version__ = "%d.%d.%d" % (BSHUF_VERSION_MAJOR, BSHUF_VERSION_MINOR,
 
 
 # Prototypes from bitshuffle.c
-cdef extern int bshuf_copy(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_byte_elem_scal(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_byte_elem_SSE(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_byte_scal(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_byte_SSE(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_byte_AVX(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bitrow_eight(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_elem_AVX(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_elem_SSE(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_elem_scal(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_byte_bitrow_SSE(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_byte_bitrow_AVX(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_byte_bitrow_scal(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_shuffle_bit_eightelem_scal(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_shuffle_bit_eightelem_SSE(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_shuffle_bit_eightelem_AVX(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_untrans_bit_elem_SSE(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_untrans_bit_elem_AVX(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_untrans_bit_elem_scal(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_trans_bit_elem(void *A, void *B, int size, int elem_size)
-cdef extern int bshuf_untrans_bit_elem(void *A, void *B, int size, int elem_size)
-
-
-ctypedef int (*Cfptr) (void *A, void *B, int size, int elem_size)
+cdef extern int bshuf_isa_available(int isa)
+cdef extern np.int64_t bshuf_copy(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_byte_elem_scal(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_byte_elem_SSE(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_byte_scal(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_byte_SSE(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_byte_AVX(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bitrow_eight(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_elem_AVX(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_elem_SSE(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_elem_scal(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_byte_bitrow_SSE(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_byte_bitrow_AVX(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_byte_bitrow_scal(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_shuffle_bit_eightelem_scal(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_shuffle_bit_eightelem_SSE(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_shuffle_bit_eightelem_AVX(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_untrans_bit_elem_SSE(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_untrans_bit_elem_AVX(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_untrans_bit_elem_scal(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_byte_AVX512(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_elem_AVX512(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_shuffle_bit_eightelem_AVX512(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_untrans_bit_elem_AVX512(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_byte_NEON(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_elem_NEON(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_shuffle_bit_eightelem_NEON(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_untrans_bit_elem_NEON(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_trans_bit_elem(void *A, void *B, size_t size, size_t elem_size)
+cdef extern np.int64_t bshuf_untrans_bit_elem(void *A, void *B, size_t size, size_t elem_size)
+
+
+ctypedef np.int64_t (*Cfptr) (void *A, void *B, size_t size, size_t elem_size)
 
 
 def using_SSE2():
-    """Whether compiled using SSE2 instructions."""
+    """Whether the selected routines use SSE2 instructions."""
     if bshuf_using_SSE2():
         return True
     else:
@@ -75,13 +175,137 @@ def using_SSE2():
 
 
 def using_AVX2():
-    """Whether compiled using AVX2 instructions."""
+    """Whether the selected routines use AVX2 instructions."""
     if bshuf_using_AVX2():
         return True
     else:
         return False
 
 
+def using_AVX512():
+    """Whether the selected routines use AVX-512BW instructions."""
+    if bshuf_using_AVX512():
+        return True
+    else:
+        return False
+
+
+def using_NEON():
+    """Whether the selected routines use ARM NEON instructions."""
+    if bshuf_using_NEON():
+        return True
+    else:
+        return False
+
+
+ISA = {'scal' : BSHUF_ISA_SCAL, 'SSE2' : BSHUF_ISA_SSE2,
+        'AVX2' : BSHUF_ISA_AVX2, 'AVX512' : BSHUF_ISA_AVX512,
+        'NEON' : BSHUF_ISA_NEON}
+
+
+def select_isa(isa=None):
+    """Select the instruction set used by the bitshuffle routines.
+
+    The best instruction set supported by the CPU is selected when the module
+    is imported; use this to override the choice, for instance to compare the
+    kernels.
+
+    Parameters
+    ----------
+    isa : {'scal', 'SSE2', 'AVX2', 'AVX512', 'NEON'}, optional
+        Instruction set. Default is the best one available.
+
+    Returns
+    -------
+    isa : string
+        The selected instruction set.
+
+    Raises
+    ------
+    RuntimeError
+        If the CPU does not support the instruction set.
+
+    """
+
+    cdef int ret
+    if isa is None:
+        ret = bshuf_select_isa(-1)
+    else:
+        ret = bshuf_select_isa(ISA[isa])
+    if ret < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % ret, ret)
+        raise excp
+    for name, value in ISA.items():
+        if value == ret:
+            return name
+
+
+select_isa()
+
+
+def set_num_threads(int nthreads=0):
+    """Set the number of threads compressing and decompressing.
+
+    Applies to calls from the current thread. Returns the previous number;
+    with *nthreads* 0 it is only queried.
+
+    """
+    return bshuf_set_num_threads(nthreads)
+
+
+def stats_enable(enable=True):
+    """Start or stop counting the work of the compressors.
+
+    Off by default. Returns whether counting was on before.
+
+    """
+    return bool(bshuf_stats_enable(1 if enable else 0))
+
+
+def stats(reset=False):
+    """The work counted since the last reset, over all threads.
+
+    Returns
+    -------
+    stats : dict
+        ``calls``, ``blocks``, ``bytes_in``, ``bytes_out``; seconds
+        elapsed in the calls, ``wall_time``, and summed over the threads
+        in bitshuffle, ``shuffle_time``, LZ4 or zlib, ``codec_time``,
+        copying output into place, ``copy_time``, and waiting for the
+        other threads, ``wait_time``. ``max_threads`` is the most
+        threads a call used, ``thread_blocks`` and ``thread_time`` the
+        blocks and busy seconds of each thread number.
+
+    """
+
+    cdef bshuf_stats S
+    cdef int ii
+    bshuf_stats_get(&S)
+    if reset:
+        bshuf_stats_reset()
+    nthreads = min(max(S.max_threads, 1), BSHUF_STATS_MAX_THREADS)
+    return {
+        'calls' : S.calls,
+        'blocks' : S.blocks,
+        'bytes_in' : S.bytes_in,
+        'bytes_out' : S.bytes_out,
+        'wall_time' : S.wall_time,
+        'shuffle_time' : S.shuffle_time,
+        'codec_time' : S.codec_time,
+        'copy_time' : S.copy_time,
+        'wait_time' : S.wait_time,
+        'max_threads' : S.max_threads,
+        'thread_blocks' : [S.thread_blocks[ii] for ii in range(nthreads)],
+        'thread_time' : [S.thread_time[ii] for ii in range(nthreads)],
+        }
+
+
+def stats_reset():
+    """Set the counts of *stats* to zero."""
+    bshuf_stats_reset()
+
+
 def _setup_arr(arr):
     shape = tuple(arr.shape)
     if not arr.flags['C_CONTIGUOUS']:
@@ -94,12 +318,84 @@ def _setup_arr(arr):
     return out, size, itemsize
 
 
+def _swap_size(dtype, byteswap):
+    """Groups of bytes reversed to byte swap elements of dtype."""
+    if not byteswap:
+        return 0
+    if dtype.kind not in 'iufc' or dtype.shape != ():
+        msg = "Can only byte swap numbers, not %s."
+        raise ValueError(msg % dtype)
+    if dtype.kind == 'c':
+        return dtype.itemsize // 2
+    return dtype.itemsize
+
+
+def _checksums(checksums, size, itemsize, block_size, writeable):
+    """Check *checksums* holds a CRC32C for each chunk."""
+    nchunk = bshuf_lz4_nchunk(size, itemsize, block_size)
+    if not writeable:
+        checksums = np.ascontiguousarray(checksums, dtype=np.uint32)
+    if (not isinstance(checksums, np.ndarray) or checksums.dtype != np.uint32
+            or checksums.ndim != 1 or not checksums.flags['C_CONTIGUOUS']
+            or checksums.shape[0] != nchunk
+            or (writeable and not checksums.flags['WRITEABLE'])):
+        msg = "Checksums must be a C-contiguous np.uint32 array of %d chunks."
+        raise ValueError(msg % nchunk)
+    return checksums
+
+
+FILTERS = {None : BSHUF_FILTER_NONE, 'delta' : BSHUF_FILTER_DELTA,
+           'xor' : BSHUF_FILTER_XOR}
+
+
+def _filter(filter, dtype):
+    """Code of the *filter* of numbers of *dtype*."""
+    if filter not in FILTERS:
+        msg = "Filter must be one of %s, not %r."
+        raise ValueError(msg % (sorted(FILTERS, key=str), filter))
+    if filter is not None and (dtype.kind not in 'iuf' or dtype.shape != ()
+            or dtype.itemsize not in (1, 2, 4, 8)):
+        msg = "Can only filter numbers of 1, 2, 4 or 8 bytes, not %s."
+        raise ValueError(msg % dtype)
+    return FILTERS[filter]
+
+
+def _stride(arr):
+    """Bytes from one element of *arr* to the next in C order if they are
+    evenly spaced, as in a field of an array of records or a slice with a
+    step; 0 if they are contiguous, -1 if neither."""
+    if arr.flags['C_CONTIGUOUS']:
+        return 0
+    stride = 0
+    span = 0
+    for n, s in reversed(list(zip(arr.shape, arr.strides))):
+        if n == 1:
+            continue
+        if stride and s != span:
+            return -1
+        if not stride:
+            stride = s
+        span = s * n
+    if stride and stride < arr.dtype.itemsize:
+        return -1
+    return stride
+
+
 @cython.boundscheck(False)
 @cython.wraparound(False)
-cdef _wrap_C_fun(Cfptr fun, np.ndarray arr):
+cdef _wrap_C_fun(Cfptr fun, np.ndarray arr, int isa=0):
     """Wrap a C function with standard call signature."""
 
-    cdef int ii, size, itemsize, count=0
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t count=0
+    if not bshuf_isa_available(isa):
+        # The kernels are compiled in regardless of the CPU; calling them
+        # would be an illegal instruction.
+        count = -10 - isa
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % count, count)
+        raise excp
     cdef np.ndarray out
     out, size, itemsize = _setup_arr(arr)
 
@@ -139,7 +435,7 @@ def trans_byte_elem_SSE(np.ndarray arr not None):
     """Transpose bytes within array elements.
 
     """
-    return _wrap_C_fun(&bshuf_trans_byte_elem_SSE, arr)
+    return _wrap_C_fun(&bshuf_trans_byte_elem_SSE, arr, BSHUF_ISA_SSE2)
 
 
 def trans_bit_byte_scal(np.ndarray arr not None):
@@ -147,11 +443,11 @@ def trans_bit_byte_scal(np.ndarray arr not None):
 
 
 def trans_bit_byte_SSE(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_trans_bit_byte_SSE, arr)
+    return _wrap_C_fun(&bshuf_trans_bit_byte_SSE, arr, BSHUF_ISA_SSE2)
 
 
 def trans_bit_byte_AVX(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_trans_bit_byte_AVX, arr)
+    return _wrap_C_fun(&bshuf_trans_bit_byte_AVX, arr, BSHUF_ISA_AVX2)
 
 
 def trans_bitrow_eight(np.ndarray arr not None):
@@ -159,7 +455,7 @@ def trans_bitrow_eight(np.ndarray arr not None):
 
 
 def trans_bit_elem_AVX(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_trans_bit_elem_AVX, arr)
+    return _wrap_C_fun(&bshuf_trans_bit_elem_AVX, arr, BSHUF_ISA_AVX2)
 
 
 def trans_bit_elem_scal(np.ndarray arr not None):
@@ -167,15 +463,15 @@ def trans_bit_elem_scal(np.ndarray arr not None):
 
 
 def trans_bit_elem_SSE(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_trans_bit_elem_SSE, arr)
+    return _wrap_C_fun(&bshuf_trans_bit_elem_SSE, arr, BSHUF_ISA_SSE2)
 
 
 def trans_byte_bitrow_SSE(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_trans_byte_bitrow_SSE, arr)
+    return _wrap_C_fun(&bshuf_trans_byte_bitrow_SSE, arr, BSHUF_ISA_SSE2)
 
 
 def trans_byte_bitrow_AVX(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_trans_byte_bitrow_AVX, arr)
+    return _wrap_C_fun(&bshuf_trans_byte_bitrow_AVX, arr, BSHUF_ISA_AVX2)
 
 
 def trans_byte_bitrow_scal(np.ndarray arr not None):
@@ -187,25 +483,58 @@ def shuffle_bit_eightelem_scal(np.ndarray arr not None):
 
 
 def shuffle_bit_eightelem_SSE(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_shuffle_bit_eightelem_SSE, arr)
+    return _wrap_C_fun(&bshuf_shuffle_bit_eightelem_SSE, arr, BSHUF_ISA_SSE2)
 
 
 def shuffle_bit_eightelem_AVX(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_shuffle_bit_eightelem_AVX, arr)
+    return _wrap_C_fun(&bshuf_shuffle_bit_eightelem_AVX, arr, BSHUF_ISA_AVX2)
 
 
 def untrans_bit_elem_SSE(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_untrans_bit_elem_SSE, arr)
+    return _wrap_C_fun(&bshuf_untrans_bit_elem_SSE, arr, BSHUF_ISA_SSE2)
 
 
 def untrans_bit_elem_AVX(np.ndarray arr not None):
-    return _wrap_C_fun(&bshuf_untrans_bit_elem_AVX, arr)
+    return _wrap_C_fun(&bshuf_untrans_bit_elem_AVX, arr, BSHUF_ISA_AVX2)
 
 
 def untrans_bit_elem_scal(np.ndarray arr not None):
     return _wrap_C_fun(&bshuf_untrans_bit_elem_scal, arr)
 
 
+def trans_bit_byte_AVX512(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_trans_bit_byte_AVX512, arr, BSHUF_ISA_AVX512)
+
+
+def trans_bit_elem_AVX512(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_trans_bit_elem_AVX512, arr, BSHUF_ISA_AVX512)
+
+
+def shuffle_bit_eightelem_AVX512(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_shuffle_bit_eightelem_AVX512, arr,
+            BSHUF_ISA_AVX512)
+
+
+def untrans_bit_elem_AVX512(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_untrans_bit_elem_AVX512, arr, BSHUF_ISA_AVX512)
+
+
+def trans_bit_byte_NEON(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_trans_bit_byte_NEON, arr, BSHUF_ISA_NEON)
+
+
+def trans_bit_elem_NEON(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_trans_bit_elem_NEON, arr, BSHUF_ISA_NEON)
+
+
+def shuffle_bit_eightelem_NEON(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_shuffle_bit_eightelem_NEON, arr, BSHUF_ISA_NEON)
+
+
+def untrans_bit_elem_NEON(np.ndarray arr not None):
+    return _wrap_C_fun(&bshuf_untrans_bit_elem_NEON, arr, BSHUF_ISA_NEON)
+
+
 def trans_bit_elem(np.ndarray arr not None):
     return _wrap_C_fun(&bshuf_trans_bit_elem, arr)
 
@@ -216,7 +545,7 @@ def untrans_bit_elem(np.ndarray arr not None):
 
 @cython.boundscheck(False)
 @cython.wraparound(False)
-def bitshuffle(np.ndarray arr not None, int block_size=0):
+def bitshuffle(np.ndarray arr not None, int block_size=0, byteswap=False):
     """Bitshuffle an array.
 
     Output array is the same shape and data type as input array but underlying
@@ -229,6 +558,9 @@ def bitshuffle(np.ndarray arr not None, int block_size=0):
     block_size : positive integer
         Block size in number of elements. By default, block size is chosen
         automatically.
+    byteswap : boolean
+        Bitshuffle ``arr.byteswap()`` instead, with no extra pass over the
+        data; unshuffling then gives the numbers in the other byte order.
 
     Returns
     -------
@@ -238,7 +570,10 @@ def bitshuffle(np.ndarray arr not None, int block_size=0):
 
     """
 
-    cdef int ii, size, itemsize, count=0
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t count=0
+    cdef size_t swap_size = _swap_size(arr.dtype, byteswap)
     cdef np.ndarray out
     out, size, itemsize = _setup_arr(arr)
 
@@ -249,8 +584,10 @@ def bitshuffle(np.ndarray arr not None, int block_size=0):
     cdef void* arr_ptr = <void*> &arr_flat[0]
     cdef void* out_ptr = <void*> &out_flat[0]
 
-    for ii in range(REPEATC):
-        count = bshuf_bitshuffle(arr_ptr, out_ptr, size, itemsize, block_size)
+    with nogil:
+        for ii in range(REPEATC):
+            count = bshuf_bitshuffle_swap(arr_ptr, out_ptr, size, itemsize,
+                                          block_size, swap_size)
     if count < 0:
         msg = "Failed. Error code %d."
         excp = RuntimeError(msg % count, count)
@@ -281,7 +618,9 @@ def bitunshuffle(np.ndarray arr not None, int block_size=0):
 
     """
 
-    cdef int ii, size, itemsize, count=0
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t count=0
     cdef np.ndarray out
     out, size, itemsize = _setup_arr(arr)
 
@@ -292,8 +631,10 @@ def bitunshuffle(np.ndarray arr not None, int block_size=0):
     cdef void* arr_ptr = <void*> &arr_flat[0]
     cdef void* out_ptr = <void*> &out_flat[0]
 
-    for ii in range(REPEATC):
-        count = bshuf_bitunshuffle(arr_ptr, out_ptr, size, itemsize, block_size)
+    with nogil:
+        for ii in range(REPEATC):
+            count = bshuf_bitunshuffle(arr_ptr, out_ptr, size, itemsize,
+                                       block_size)
     if count < 0:
         msg = "Failed. Error code %d."
         excp = RuntimeError(msg % count, count)
@@ -303,46 +644,99 @@ def bitunshuffle(np.ndarray arr not None, int block_size=0):
 
 @cython.boundscheck(False)
 @cython.wraparound(False)
-def compress_lz4(np.ndarray arr not None, int block_size=0):
+def compress_lz4(np.ndarray arr not None, int block_size=0,
+                 np.ndarray out=None, byteswap=False, checksums=None,
+                 filter=None, size_t distance=1):
     """Bitshuffle then compress an array using LZ4.
 
+    The GIL is released while compressing.
+
     Parameters
     ----------
     arr : numpy array
-        Data to ne processed.
+        Data to ne processed. Evenly spaced elements, a field of an array of
+        records or a slice with a step, are gathered a block at a time as they
+        are compressed; other arrays that are not C-contiguous are copied.
     block_size : positive integer
         Block size in number of elements. By default, block size is chosen
         automatically.
+    out : array with np.uint8 data type
+        Buffer to hold the compressed data, must be C-contiguous and at least
+        `compress_lz4_bound` bytes long. By default a new buffer is allocated.
+    byteswap : boolean
+        Compress ``arr.byteswap()`` instead, with no extra pass over the
+        data, e.g. to store big endian numbers in native order.
+    checksums : array with np.uint32 data type
+        Filled with the CRC32C of the compressed bytes of each chunk (see
+        `lz4_chunk_offsets`), for `decompress_lz4` to verify. Must be
+        C-contiguous and hold one per chunk.
+    filter : None, 'delta' or 'xor'
+        Store each number of a block as its difference to, or for floats its
+        exclusive or with, the number *distance* elements before it, for
+        smooth images and sorted columns. `decompress_lz4` must be given the
+        same filter and distance.
+    distance : positive integer
+        Elements back the filter looks, e.g. the length of a row to take the
+        difference to the pixel above.
 
     Returns
     -------
     out : array with np.uint8 data type
-        Buffer holding compressed data.
+        Buffer holding compressed data, a view into *out* if provided.
 
     """
 
-    cdef int ii, size, itemsize, count=0
-    shape = (arr.shape[i] for i in range(arr.ndim))
-    if not arr.flags['C_CONTIGUOUS']:
-        msg = "Input array must be C-contiguous."
-        raise ValueError(msg)
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t max_out_size, count=0
+    cdef bshuf_opts opts
+    opts.level = 0
+    opts.swap_size = _swap_size(arr.dtype, byteswap)
+    opts.checksums = NULL
+    opts.safe = 0
+    opts.stride = 0
+    opts.filter = _filter(filter, arr.dtype)
+    opts.filter_distance = distance
+    # the numbers are stored byte swapped
+    opts.filter_swap = (not arr.dtype.isnative) != bool(byteswap)
+    step = _stride(arr)
+    if step < 0:
+        arr = np.ascontiguousarray(arr)
+    else:
+        opts.stride = step
     size = arr.size
     dtype = arr.dtype
     itemsize = dtype.itemsize
 
-    max_out_size = bshuf_compress_lz4_bound(size, itemsize, block_size)
+    max_out_size = <np.int64_t> bshuf_compress_lz4_bound(size, itemsize,
+                                                         block_size)
+    if max_out_size < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % max_out_size, max_out_size)
+        raise excp
 
-    cdef np.ndarray out
-    out = np.empty(max_out_size, dtype=np.uint8)
+    if out is None:
+        out = np.empty(max_out_size, dtype=np.uint8)
+    elif (out.dtype != np.uint8 or out.ndim != 1
+            or not out.flags['C_CONTIGUOUS'] or out.size < max_out_size):
+        msg = "Output buffer must be C-contiguous np.uint8 of at least %d bytes."
+        raise ValueError(msg % max_out_size)
 
-    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] arr_flat
-    arr_flat = arr.view(np.uint8).ravel()
     cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] out_flat
-    out_flat = out.view(np.uint8).ravel()
-    cdef void* arr_ptr = <void*> &arr_flat[0]
+    out_flat = out
+    # the first element, strided or not
+    cdef void* arr_ptr = np.PyArray_DATA(arr)
     cdef void* out_ptr = <void*> &out_flat[0]
-    for ii in range(REPEATC):
-        count = bshuf_compress_lz4(arr_ptr, out_ptr, size, itemsize, block_size)
+    cdef np.ndarray[dtype=np.uint32_t, ndim=1, mode="c"] checksums_arr
+    if checksums is not None:
+        checksums_arr = _checksums(checksums, size, itemsize, block_size,
+                                   True)
+        if checksums_arr.shape[0] > 0:
+            opts.checksums = &checksums_arr[0]
+    with nogil:
+        for ii in range(REPEATC):
+            count = bshuf_compress_lz4_opts(arr_ptr, out_ptr, size, itemsize,
+                                            block_size, &opts)
     if count < 0:
         msg = "Failed. Error code %d."
         excp = RuntimeError(msg % count, count)
@@ -350,11 +744,38 @@ def compress_lz4(np.ndarray arr not None, int block_size=0):
     return out[:count]
 
 
+def compress_lz4_bound(size, int itemsize, int block_size=0):
+    """Bound on the size of the buffer returned by `compress_lz4`.
+
+    Parameters
+    ----------
+    size : integer
+        Number of elements in the data array.
+    itemsize : positive integer
+        Size of the data elements in bytes.
+    block_size : positive integer
+        Block size in number of elements. By default, block size is chosen
+        automatically.
+
+    Returns
+    -------
+    bound : integer
+        Size of the compressed data in bytes is no more than this.
+
+    """
+
+    return <np.int64_t> bshuf_compress_lz4_bound(size, itemsize, block_size)
+
+
 @cython.boundscheck(False)
 @cython.wraparound(False)
-def decompress_lz4(np.ndarray arr not None, shape, dtype, int block_size=0):
+def decompress_lz4(np.ndarray arr not None, shape, dtype, int block_size=0,
+                   np.ndarray out=None, offsets=None, checksums=None,
+                   filter=None, size_t distance=1):
     """Decompress a buffer using LZ4 then bitunshuffle it yielding an array.
 
+    The GIL is released while decompressing.
+
     Parameters
     ----------
     arr : numpy array
@@ -368,6 +789,19 @@ def decompress_lz4(np.ndarray arr not None, shape, dtype, int block_size=0):
     block_size : positive integer
         Block size in number of elements. Must match value used for
         compression.
+    out : numpy array with shape *shape* and data type *dtype*
+        Array to hold the decompressed data, must be C-contiguous. By default
+        a new array is allocated.
+    offsets : array of integers
+        Chunk offsets returned by `lz4_chunk_offsets`, relative to the start
+        of *arr*. The blocks are then decompressed independently without
+        walking the block headers first.
+    checksums : array of integers
+        CRC32C of each chunk from `compress_lz4`. Every chunk is verified by
+        the thread decompressing it, and decompressed with the safe LZ4
+        decoder; a mismatch raises a RuntimeError with error code -92.
+    filter, distance :
+        Filter given to `compress_lz4`, undone after unshuffling each block.
 
     Returns
     -------
@@ -376,25 +810,250 @@ def decompress_lz4(np.ndarray arr not None, shape, dtype, int block_size=0):
 
     """
 
-    cdef int ii, size, itemsize, count=0
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t count=0
     if not arr.flags['C_CONTIGUOUS']:
         msg = "Input array must be C-contiguous."
         raise ValueError(msg)
-    size = np.prod(shape)
+    shape = tuple(shape)
+    dtype = np.dtype(dtype)
+    size = np.prod(shape, dtype=np.int64)
     itemsize = dtype.itemsize
+    cdef bshuf_opts opts
+    opts.level = 0
+    opts.swap_size = 0
+    opts.checksums = NULL
+    opts.safe = 0
+    opts.stride = 0
+    opts.filter = _filter(filter, dtype)
+    opts.filter_distance = distance
+    opts.filter_swap = not dtype.isnative
+
+    if out is None:
+        out = np.empty(shape, dtype=dtype)
+    elif (out.shape != shape or out.dtype != dtype
+            or not out.flags['C_CONTIGUOUS'] or not out.flags['WRITEABLE']):
+        msg = "Output array must be writeable, C-contiguous, of shape %s and "
+        msg += "data type %s."
+        raise ValueError(msg % (shape, dtype))
+
+    cdef np.ndarray[dtype=np.uint64_t, ndim=1, mode="c"] offsets_arr
+    cdef np.uint64_t* offsets_ptr = NULL
+    if offsets is not None:
+        offsets_arr = np.ascontiguousarray(offsets, dtype=np.uint64)
+        nchunk = bshuf_lz4_nchunk(size, itemsize, block_size)
+        if (nchunk < 0 or offsets_arr.shape[0] != nchunk + 1
+                or offsets_arr[0] != 0 or offsets_arr[nchunk] != arr.size):
+            msg = "Offsets do not describe %d chunks in %d bytes."
+            raise ValueError(msg % (nchunk, arr.size))
+        offsets_ptr = &offsets_arr[0]
 
-    cdef np.ndarray out
-    out = np.empty(tuple(shape), dtype=dtype)
+    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] arr_flat
+    arr_flat = arr.view(np.uint8).ravel()
+    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] out_flat
+    out_flat = out.view(np.uint8).ravel()
+    cdef void* arr_ptr = <void*> &arr_flat[0]
+    cdef size_t in_size = arr_flat.shape[0]
+    cdef void* out_ptr = <void*> &out_flat[0]
+    cdef np.ndarray[dtype=np.uint32_t, ndim=1, mode="c"] checksums_arr
+    if checksums is not None:
+        checksums_arr = _checksums(checksums, size, itemsize, block_size,
+                                   False)
+        if checksums_arr.shape[0] > 0:
+            opts.checksums = &checksums_arr[0]
+            opts.safe = 1
+    with nogil:
+        for ii in range(REPEATC):
+            count = bshuf_decompress_lz4_opts(arr_ptr, in_size, out_ptr,
+                                              size, itemsize, block_size,
+                                              offsets_ptr, &opts)
+    if count < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % count, count)
+        raise excp
+    if count != arr.size:
+        msg = "Decompressed different number of bytes than input buffer size."
+        msg += "Input buffer %d, decompressed %d." % (arr.size, count)
+        raise RuntimeError(msg, count)
+    return out
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def compress_zlib(np.ndarray arr not None, int block_size=0, int level=9,
+                  np.ndarray out=None, byteswap=False, checksums=None,
+                  filter=None, size_t distance=1):
+    """Bitshuffle then compress an array using zlib.
+
+    Slower than `compress_lz4`, for a better ratio. The chunks of the output
+    are located by `lz4_chunk_offsets`, as for `compress_lz4`. The GIL is
+    released while compressing.
+
+    Parameters
+    ----------
+    arr : numpy array
+        Data to ne processed, see `compress_lz4`.
+    block_size : positive integer
+        Block size in number of elements. By default, block size is chosen
+        automatically.
+    level : integer
+        zlib compression level, 1 (fastest) to 9 (best).
+    out : array with np.uint8 data type
+        Buffer to hold the compressed data, must be C-contiguous and at least
+        `compress_zlib_bound` bytes long. By default a new buffer is allocated.
+    byteswap : boolean
+        Compress ``arr.byteswap()`` instead, see `compress_lz4`.
+    checksums : array with np.uint32 data type
+        Filled with the CRC32C of each chunk, see `compress_lz4`.
+    filter, distance :
+        Filter of the numbers of each block, see `compress_lz4`.
+
+    Returns
+    -------
+    out : array with np.uint8 data type
+        Buffer holding compressed data, a view into *out* if provided.
+
+    """
+
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t max_out_size, count=0
+    cdef bshuf_opts opts
+    opts.level = 0
+    opts.swap_size = _swap_size(arr.dtype, byteswap)
+    opts.checksums = NULL
+    opts.safe = 0
+    opts.stride = 0
+    opts.filter = _filter(filter, arr.dtype)
+    opts.filter_distance = distance
+    # the numbers are stored byte swapped
+    opts.filter_swap = (not arr.dtype.isnative) != bool(byteswap)
+    step = _stride(arr)
+    if step < 0:
+        arr = np.ascontiguousarray(arr)
+    else:
+        opts.stride = step
+    size = arr.size
+    dtype = arr.dtype
+    itemsize = dtype.itemsize
+
+    max_out_size = <np.int64_t> bshuf_compress_zlib_bound(size, itemsize,
+                                                          block_size)
+    if max_out_size < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % max_out_size, max_out_size)
+        raise excp
+
+    if out is None:
+        out = np.empty(max_out_size, dtype=np.uint8)
+    elif (out.dtype != np.uint8 or out.ndim != 1
+            or not out.flags['C_CONTIGUOUS'] or out.size < max_out_size):
+        msg = "Output buffer must be C-contiguous np.uint8 of at least %d bytes."
+        raise ValueError(msg % max_out_size)
+
+    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] out_flat
+    out_flat = out
+    # the first element, strided or not
+    cdef void* arr_ptr = np.PyArray_DATA(arr)
+    cdef void* out_ptr = <void*> &out_flat[0]
+    cdef np.ndarray[dtype=np.uint32_t, ndim=1, mode="c"] checksums_arr
+    opts.level = level
+    if checksums is not None:
+        checksums_arr = _checksums(checksums, size, itemsize, block_size,
+                                   True)
+        if checksums_arr.shape[0] > 0:
+            opts.checksums = &checksums_arr[0]
+    with nogil:
+        for ii in range(REPEATC):
+            count = bshuf_compress_zlib_opts(arr_ptr, out_ptr, size, itemsize,
+                                             block_size, &opts)
+    if count < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % count, count)
+        raise excp
+    return out[:count]
+
+
+def compress_zlib_bound(size, int itemsize, int block_size=0):
+    """Bound on the size of the buffer returned by `compress_zlib`.
+
+    See `compress_lz4_bound`.
+
+    """
+
+    return <np.int64_t> bshuf_compress_zlib_bound(size, itemsize, block_size)
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def decompress_zlib(np.ndarray arr not None, shape, dtype, int block_size=0,
+                    np.ndarray out=None, offsets=None, checksums=None,
+                    filter=None, size_t distance=1):
+    """Decompress a buffer using zlib then bitunshuffle it yielding an array.
+
+    Undoes `compress_zlib`; the arguments are those of `decompress_lz4`.
+
+    """
+
+    cdef int ii
+    cdef size_t size, itemsize
+    cdef np.int64_t count=0
+    if not arr.flags['C_CONTIGUOUS']:
+        msg = "Input array must be C-contiguous."
+        raise ValueError(msg)
+    shape = tuple(shape)
+    dtype = np.dtype(dtype)
+    size = np.prod(shape, dtype=np.int64)
+    itemsize = dtype.itemsize
+    cdef bshuf_opts opts
+    opts.level = 0
+    opts.swap_size = 0
+    opts.checksums = NULL
+    opts.safe = 0
+    opts.stride = 0
+    opts.filter = _filter(filter, dtype)
+    opts.filter_distance = distance
+    opts.filter_swap = not dtype.isnative
+
+    if out is None:
+        out = np.empty(shape, dtype=dtype)
+    elif (out.shape != shape or out.dtype != dtype
+            or not out.flags['C_CONTIGUOUS'] or not out.flags['WRITEABLE']):
+        msg = "Output array must be writeable, C-contiguous, of shape %s and "
+        msg += "data type %s."
+        raise ValueError(msg % (shape, dtype))
+
+    cdef np.ndarray[dtype=np.uint64_t, ndim=1, mode="c"] offsets_arr
+    cdef np.uint64_t* offsets_ptr = NULL
+    if offsets is not None:
+        offsets_arr = np.ascontiguousarray(offsets, dtype=np.uint64)
+        nchunk = bshuf_lz4_nchunk(size, itemsize, block_size)
+        if (nchunk < 0 or offsets_arr.shape[0] != nchunk + 1
+                or offsets_arr[0] != 0 or offsets_arr[nchunk] != arr.size):
+            msg = "Offsets do not describe %d chunks in %d bytes."
+            raise ValueError(msg % (nchunk, arr.size))
+        offsets_ptr = &offsets_arr[0]
 
     cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] arr_flat
     arr_flat = arr.view(np.uint8).ravel()
     cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] out_flat
     out_flat = out.view(np.uint8).ravel()
     cdef void* arr_ptr = <void*> &arr_flat[0]
+    cdef size_t in_size = arr_flat.shape[0]
     cdef void* out_ptr = <void*> &out_flat[0]
-    for ii in range(REPEATC):
-        count = bshuf_decompress_lz4(arr_ptr, out_ptr, size, itemsize,
-                                     block_size)
+    cdef np.ndarray[dtype=np.uint32_t, ndim=1, mode="c"] checksums_arr
+    if checksums is not None:
+        checksums_arr = _checksums(checksums, size, itemsize, block_size,
+                                   False)
+        if checksums_arr.shape[0] > 0:
+            opts.checksums = &checksums_arr[0]
+            opts.safe = 1
+    with nogil:
+        for ii in range(REPEATC):
+            count = bshuf_decompress_zlib_opts(arr_ptr, in_size, out_ptr,
+                                               size, itemsize, block_size,
+                                               offsets_ptr, &opts)
     if count < 0:
         msg = "Failed. Error code %d."
         excp = RuntimeError(msg % count, count)
@@ -406,3 +1065,137 @@ def decompress_lz4(np.ndarray arr not None, shape, dtype, int block_size=0):
     return out
 
 
+def default_block_size(int itemsize):
+    """Block size in number of elements used when *block_size* is 0.
+
+    Parameters
+    ----------
+    itemsize : positive integer
+        Size of the data elements in bytes.
+
+    Returns
+    -------
+    block_size : integer
+        Block size in number of elements.
+
+    """
+
+    return bshuf_default_block_size(itemsize)
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def lz4_chunk_offsets(np.ndarray arr not None, size, int itemsize,
+                      int block_size=0):
+    """Locate the independently decompressable chunks of a compressed buffer.
+
+    Chunk *i* holds elements *i * block_size* to *(i + 1) * block_size* of the
+    data. The bytes from ``out[i]`` to ``out[j]`` can be passed to
+    `decompress_lz4` to obtain the elements of chunks *i* to *j*.
+
+    Parameters
+    ----------
+    arr : numpy array
+        Buffer holding data compressed by `compress_lz4`.
+    size : integer
+        Number of elements in the original data array.
+    itemsize : positive integer
+        Size of the data elements in bytes.
+    block_size : positive integer
+        Block size in number of elements. Must match value used for
+        compression.
+
+    Returns
+    -------
+    out : array with np.uint64 data type
+        Offsets of the start of each chunk, followed by the total number of
+        bytes in the buffer.
+
+    """
+
+    cdef np.int64_t count
+    if not arr.flags['C_CONTIGUOUS']:
+        msg = "Input array must be C-contiguous."
+        raise ValueError(msg)
+    count = bshuf_lz4_nchunk(size, itemsize, block_size)
+    if count < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % count, count)
+        raise excp
+
+    cdef np.ndarray[dtype=np.uint64_t, ndim=1, mode="c"] out
+    out = np.empty(count + 1, dtype=np.uint64)
+
+    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] arr_flat
+    arr_flat = arr.view(np.uint8).ravel()
+    cdef void* arr_ptr = NULL
+    if arr_flat.shape[0] > 0:
+        arr_ptr = <void*> &arr_flat[0]
+    count = bshuf_lz4_chunk_offsets(arr_ptr, arr_flat.shape[0], &out[0],
+                                    size, itemsize, block_size)
+    if count < 0:
+        msg = "Failed. Error code %d."
+        excp = RuntimeError(msg % count, count)
+        raise excp
+    return out
+
+
+def crc32c(np.ndarray arr not None, crc=0):
+    """CRC32C (Castagnoli) of the bytes of an array.
+
+    Uses the crc32 instruction of SSE4.2 or ARMv8 if the CPU has it. Pass the
+    CRC of the preceding bytes as *crc* to continue it.
+
+    """
+
+    if not arr.flags['C_CONTIGUOUS']:
+        msg = "Input array must be C-contiguous."
+        raise ValueError(msg)
+    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] arr_flat
+    arr_flat = arr.view(np.uint8).ravel()
+    cdef void* arr_ptr = NULL
+    cdef size_t nbytes = arr_flat.shape[0]
+    cdef np.uint32_t c = crc
+    if nbytes > 0:
+        arr_ptr = <void*> &arr_flat[0]
+    with nogil:
+        c = bshuf_crc32c(c, arr_ptr, nbytes)
+    return c
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def crc32c_chunks(np.ndarray arr not None, offsets):
+    """CRC32C of each chunk of a buffer, in parallel.
+
+    Chunk *i* is the bytes ``arr[offsets[i]:offsets[i + 1]]``. The checksums
+    match those of `compress_lz4` for its chunks.
+
+    Returns
+    -------
+    out : array with np.uint32 data type
+        One checksum per chunk.
+
+    """
+
+    if not arr.flags['C_CONTIGUOUS']:
+        msg = "Input array must be C-contiguous."
+        raise ValueError(msg)
+    cdef np.ndarray[dtype=np.uint64_t, ndim=1, mode="c"] offsets_arr
+    offsets_arr = np.ascontiguousarray(offsets, dtype=np.uint64)
+    cdef np.ndarray[dtype=np.uint8_t, ndim=1, mode="c"] arr_flat
+    arr_flat = arr.view(np.uint8).ravel()
+    cdef size_t nchunk = max(offsets_arr.shape[0] - 1, 0)
+    if nchunk and (np.any(np.diff(offsets_arr.view(np.int64)) < 0)
+            or offsets_arr[nchunk] > <np.uint64_t> arr_flat.shape[0]):
+        msg = "Offsets do not describe %d chunks in %d bytes."
+        raise ValueError(msg % (nchunk, arr_flat.shape[0]))
+    cdef np.ndarray[dtype=np.uint32_t, ndim=1, mode="c"] out
+    if nchunk == 0 or arr_flat.shape[0] == 0:
+        # empty chunks only
+        return np.zeros(nchunk, dtype=np.uint32)
+    out = np.empty(nchunk, dtype=np.uint32)
+    cdef void* arr_ptr = <void*> &arr_flat[0]
+    with nogil:
+        bshuf_crc32c_chunks(arr_ptr, &offsets_arr[0], nchunk, &out[0])
+    return out
@@ -0,0 +1,73 @@
+""" A process-wide cache of decompressed chunks and parsed metadata,
+    shared by all Block objects. Entries are keyed by the path, mtime
+    and size of the file they come from, so a rewritten file is never
+    served from the cache. """
+import os
+import threading
+from collections import OrderedDict
+
+class LRUCache(object):
+    """ Holds up to nbytes of values, evicting the least recently
+        used first. Thread safe. """
+    def __init__(self, nbytes):
+        self.nbytes = nbytes
+        self.used = 0
+        self.hits = 0
+        self.misses = 0
+        self.entries = OrderedDict()
+        self.lock = threading.Lock()
+
+    def get(self, key):
+        """ The value of key, or None """
+        with self.lock:
+            try:
+                value, nbytes = self.entries.pop(key)
+            except KeyError:
+                self.misses += 1
+                return None
+            self.entries[key] = (value, nbytes)
+            self.hits += 1
+            return value
+
+    def put(self, key, value, nbytes):
+        """ Add value, taking nbytes of the budget """
+        if nbytes > self.nbytes:
+            return
+        with self.lock:
+            if key in self.entries:
+                self.used -= self.entries.pop(key)[1]
+            self.entries[key] = (value, nbytes)
+            self.used += nbytes
+            self._shrink()
+
+    def evict(self, path):
+        """ Drop the entries of the file at path """
+        with self.lock:
+            for key in [key for key in self.entries if key[0] == path]:
+                self.used -= self.entries.pop(key)[1]
+
+    def resize(self, nbytes):
+        """ Change the budget; 0 disables the cache """
+        with self.lock:
+            self.nbytes = nbytes
+            self._shrink()
+
+    def clear(self):
+        with self.lock:
+            self.entries.clear()
+            self.used = 0
+
+    def _shrink(self):
+        while self.used > self.nbytes:
+            key, (value, nbytes) = self.entries.popitem(last=False)
+            self.used -= nbytes
+
+def filekey(path):
+    """ path, mtime and size of the file, None if it does not exist """
+    try:
+        st = os.stat(path)
+    except OSError:
+        return None
+    return (path, st.st_mtime, st.st_size)
+
+default = LRUCache(256 * 1024 * 1024)
@@ -0,0 +1,171 @@
+""" Sequential reading of gzipped FITS files, one HDU after the other,
+    as the gzip stream is decompressed. cfitsio decompresses the whole
+    file into memory before the first HDU can be read.
+
+    Only images are read: unscaled, or with the BZERO that makes an
+    integer image unsigned, which is what fitsio returns them as.
+    Other HDUs raise Unsupported. """
+import gzip
+import numpy
+
+BLOCK = 2880
+
+class Unsupported(Exception):
+    """ An HDU this reader can not return as fitsio would """
+    pass
+
+_BITPIX = {8 : 'u1', 16 : 'i2', 32 : 'i4', 64 : 'i8', -32 : 'f4', -64 : 'f8'}
+
+# BZERO of the unsigned (and for bytes the signed) integers
+_ZERO = {8 : (-128, 'i1'), 16 : (2 ** 15, 'u2'),
+        32 : (2 ** 31, 'u4'), 64 : (2 ** 63, 'u8')}
+
+def parse_value(text):
+    """ Value of a header card, as fitsio returns it """
+    text = text.strip()
+    if text.startswith("'"):
+        end = 1
+        while True:
+            end = text.find("'", end)
+            if end < 0:
+                raise Unsupported("unterminated string %s" % text)
+            if text[end + 1:end + 2] == "'":
+                end += 2
+                continue
+            break
+        return text[1:end].replace("''", "'").rstrip(), text[end + 1:]
+    comment = text.find('/')
+    if comment >= 0:
+        text, rest = text[:comment].strip(), text[comment:]
+    else:
+        rest = ''
+    if text == 'T':
+        return True, rest
+    if text == 'F':
+        return False, rest
+    if text == '':
+        return None, rest
+    try:
+        return int(text), rest
+    except ValueError:
+        pass
+    try:
+        return float(text.replace('D', 'E')), rest
+    except ValueError:
+        return text, rest
+
+def read_header(ff):
+    """ The header at the current position of ff as a dict, or None
+        at the end of the file. """
+    header = {}
+    last = None
+    while True:
+        record = ff.read(BLOCK)
+        if len(record) == 0 and len(header) == 0:
+            return None
+        if len(record) < BLOCK:
+            raise IOError("truncated FITS header")
+        for i in range(0, BLOCK, 80):
+            card = record[i:i + 80]
+            key = card[:8].strip()
+            if key == 'END':
+                return header
+            if key == 'CONTINUE' and last is not None:
+                # long strings end with & in the card they continue
+                value, rest = parse_value(card[8:])
+                header[last] = header[last][:-1] + value
+                if not header[last].endswith('&'):
+                    last = None
+                continue
+            last = None
+            if key in ('', 'COMMENT', 'HISTORY') or card[8:10] != '= ':
+                continue
+            value, rest = parse_value(card[10:])
+            header[key] = value
+            if isinstance(value, basestring) and value.endswith('&'):
+                last = key
+
+class HDU(object):
+    """ An HDU of the file, its data read a band of rows at a time
+        and in order. """
+    def __init__(self, ff, header):
+        self.ff = ff
+        self.header = header
+        naxis = header.get('NAXIS', 0)
+        # rows first, as fitsio
+        self.shape = tuple(header['NAXIS%d' % (i + 1)]
+                for i in reversed(range(naxis)))
+        bitpix = header['BITPIX']
+        size = int(numpy.prod(self.shape)) if naxis else 0
+        nbytes = abs(bitpix) // 8 * header.get('GCOUNT', 1) * (
+                header.get('PCOUNT', 0) + size)
+        self.padded = -(-nbytes // BLOCK) * BLOCK
+        self.consumed = 0
+        self.row = 0
+
+        if (header.get('XTENSION', 'IMAGE') != 'IMAGE'
+                or header.get('GROUPS')):
+            self.dtype = None
+            return
+        # big endian, as fitsio returns it
+        self.raw = numpy.dtype('>' + _BITPIX[bitpix])
+        self.dtype = self.raw
+        self.flip = False
+        bscale = header.get('BSCALE', 1)
+        bzero = header.get('BZERO', 0)
+        if bscale == 1 and bzero == 0:
+            return
+        if bscale == 1 and bitpix in _ZERO and bzero == _ZERO[bitpix][0]:
+            # adding BZERO flips the sign bit
+            self.dtype = numpy.dtype('>' + _ZERO[bitpix][1])
+            self.flip = True
+            return
+        self.dtype = None
+
+    def has_data(self):
+        return len(self.shape) > 0 and self.shape[0] > 0
+
+    def read(self, lo, hi):
+        """ Rows lo to hi; lo is where the previous read stopped. """
+        if self.dtype is None:
+            raise Unsupported("can only stream images, %s is not one" %
+                    self.header.get('XTENSION', 'the primary HDU'))
+        assert lo == self.row
+        rowshape = self.shape[1:]
+        count = (hi - lo) * int(numpy.prod(rowshape))
+        buf = self.ff.read(count * self.raw.itemsize)
+        if len(buf) != count * self.raw.itemsize:
+            raise IOError("truncated FITS data")
+        self.consumed += len(buf)
+        self.row = hi
+        rows = numpy.fromstring(buf, dtype=self.raw)
+        if self.flip:
+            # the sign bit is in the first byte of big endian elements
+            rows.view('u1')[::self.raw.itemsize] ^= 0x80
+            rows = rows.view(self.dtype)
+        return rows.reshape((hi - lo,) + rowshape)
+
+    def skip(self):
+        """ Moves to the next HDU, past the unread data and padding. """
+        left = self.padded - self.consumed
+        while left > 0:
+            buf = self.ff.read(min(left, 1024 * 1024))
+            if len(buf) == 0:
+                raise IOError("truncated FITS data")
+            left -= len(buf)
+        self.consumed = self.padded
+
+def open(filename):
+    """ Yields the HDUs of a gzipped FITS file in order; each must be
+        read before the next is asked for, and is skipped otherwise. """
+    ff = gzip.GzipFile(filename, 'rb')
+    try:
+        while True:
+            header = read_header(ff)
+            if header is None:
+                break
+            hdu = HDU(ff, header)
+            yield hdu
+            hdu.skip()
+    finally:
+        ff.close()
@@ -0,0 +1,139 @@
+""" Reading and writing a block with all the ranks of an MPI
+    communicator (mpi4py), each taking a band of rows.
+
+    The bands start at a chunk boundary of every stream, so no chunk
+    is decompressed, or compressed, by two ranks:
+
+        lo, hi, rows = fsfits.mpi.read(comm, block)
+
+    Writing is collective; each rank compresses its band, and the
+    offsets of the compressed bytes in the data files are the
+    exclusive prefix sum of their sizes:
+
+        lo, hi = fsfits.mpi.partition(comm, block)
+        fsfits.mpi.write(comm, block, data[lo:hi], lo)
+    """
+import os.path
+import fractions
+import numpy
+import fsfits
+import cache
+
+def partition(comm, block):
+    """ Rows lo to hi of the block for this rank: about equal bands,
+        in the order of the ranks, starting at chunk boundaries. """
+    nrows = block.shape[0]
+    unit = _row_unit(block)
+    nunits = -(-nrows // unit)
+    lo = nunits * comm.rank // comm.size * unit
+    hi = nunits * (comm.rank + 1) // comm.size * unit
+    return min(lo, nrows), min(hi, nrows)
+
+def _row_unit(block):
+    """ Rows in the least band starting at a chunk boundary of all
+        the streams of block. """
+    if block.layout == 'tiles':
+        return block.tiles[0]
+    rowsize = int(numpy.prod(block.shape[1:]))
+    unit = 1
+    for stream, subshape in block.streams.values():
+        n = rowsize * int(numpy.prod(subshape))
+        bs = stream.block_size
+        u = bs // fractions.gcd(bs, n) if n else 1
+        unit = unit * u // fractions.gcd(unit, u)
+    return unit
+
+def read(comm, block, columns=None):
+    """ The band of rows of this rank, as lo, hi and the rows. """
+    lo, hi = partition(comm, block)
+    return lo, hi, block.read(slice(lo, hi), columns=columns)
+
+def tune(comm, block, sample=None):
+    """ Pick the block sizes of a block created with block_size 'auto'
+        on rank 0, from sample, its first rows, for all the ranks.
+        Before partition, which depends on them. """
+    sizes = None
+    if comm.rank == 0:
+        block._autotune(block._as_rows(sample))
+        sizes = block.block_size
+    sizes = comm.bcast(sizes, root=0)
+    block.block_size = sizes
+    for name, (stream, subshape) in block.streams.items():
+        stream.set_block_size(sizes[name])
+
+def write(comm, block, rows, lo):
+    """ Write all of an unwritten block, collectively: rows are rows lo
+        to lo + len(rows), the band of this rank from partition. Rank
+        0 writes the chunk indexes and dtype.pickle once all ranks
+        have written their chunks. """
+    if block.dtype is None or len(block.shape) == 0 \
+        or block.layout == 'tiles':
+        raise ValueError("collective writes need rows of a flat or"
+                " columns block")
+    if block.block_size == 'auto':
+        raise ValueError("block_size is auto, pick it with tune first")
+    if (lo, lo + len(rows)) != partition(comm, block):
+        raise ValueError("rows %d to %d are not the band of rank %d"
+                % (lo, lo + len(rows), comm.rank))
+    rows = block._as_rows(rows)
+    for name, (stream, subshape) in sorted(block.streams.items()):
+        _write_stream(comm, stream, rows if name is None else rows[name])
+    block.unwritten = False
+    if comm.rank == 0:
+        block.flush()
+    comm.barrier()
+
+def _write_stream(comm, stream, elements):
+    """ The chunks of elements at the offset of this rank in the data
+        file; the index, zone map and checksums of all ranks are
+        gathered on rank 0, as ChunkWriter would write them. """
+    elements = numpy.asarray(elements)
+    if not fsfits._swappable(elements.dtype, stream.dtype):
+        elements = numpy.asarray(elements, stream.dtype)
+    elements = elements.reshape(-1)
+    bs = stream.block_size
+    zonemap = None
+    if stream.dtype.kind in 'iuf' and stream.dtype.shape == ():
+        zonemap = fsfits._zonemap(elements, bs)
+    if len(elements):
+        compressed, offsets, checksums = fsfits._encode(stream.codec,
+                elements, bs, elements.dtype != stream.dtype,
+                stream.checksums, stream.filter)
+    else:
+        compressed = numpy.empty(0, dtype='u1')
+        offsets = numpy.zeros(1, dtype='u8')
+        checksums = numpy.empty(0, dtype='u4') if stream.checksums \
+                else None
+
+    start = comm.exscan(len(compressed))
+    if comm.rank == 0:
+        start = 0
+        file(stream.datafilename, 'w').close()
+    comm.barrier()
+    if len(compressed):
+        with file(stream.datafilename, 'r+b') as ff:
+            ff.seek(start)
+            compressed.tofile(ff)
+    parts = comm.gather((offsets[1:] + start, zonemap, checksums), root=0)
+
+    if comm.rank == 0:
+        index = numpy.concatenate([numpy.zeros(1, dtype='u8')]
+                + [part[0] for part in parts])
+        fsfits._replace(stream.indexfilename, index.astype('<u8').tofile)
+        if zonemap is not None:
+            zonemap = numpy.concatenate([part[1] for part in parts])
+            fsfits._replace(stream.zonemapfilename,
+                    lambda ff: numpy.save(ff, zonemap))
+        elif os.path.exists(stream.zonemapfilename):
+            os.remove(stream.zonemapfilename)
+        if checksums is not None:
+            fsfits._replace(stream.checksumfilename, numpy.concatenate(
+                [part[2] for part in parts]).astype('<u4').tofile)
+        elif os.path.exists(stream.checksumfilename):
+            os.remove(stream.checksumfilename)
+    for filename in (stream.datafilename, stream.indexfilename,
+            stream.zonemapfilename, stream.checksumfilename):
+        cache.default.evict(filename)
+    stream._index = None
+    stream._zonemap = None
+    stream._checksums = None
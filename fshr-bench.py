@@ -0,0 +1,291 @@
+""" Benchmark fsfits against FITS (fitsio) and HDF5 (h5py, if installed)
+    on the files of testdata/files, and time the compression kernels
+    across thread counts and block sizes. Results are written as JSON.
+
+    Times are the best of --repeat runs, with the files in the page
+    cache after the first. The chunk cache of fsfits is cleared before
+    every run, so each read decompresses. """
+import fitsio
+import fsfits
+from fsfits import bitshuffle
+from argparse import ArgumentParser
+import multiprocessing
+import platform
+import shutil
+import tempfile
+import time
+import json
+import sys
+import os.path
+import numpy
+
+try:
+    import h5py
+except ImportError:
+    h5py = None
+
+ap = ArgumentParser()
+
+ap.add_argument('--root', default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), 'testdata'),
+        help="Where testdata/sync.sh put the files")
+
+ap.add_argument('--repeat', type=int, default=3,
+        help="Runs of each measurement; the fastest is reported")
+
+ap.add_argument('--threads', default=None,
+        help="Thread counts of the kernel timings, e.g. 1,2,4;"
+             " default 1 and all cores")
+
+ap.add_argument('--block-sizes', default='0,256,1024,4096,16384',
+        help="Block sizes in elements of the kernel timings, 0 is the"
+             " default of the dtype")
+
+ap.add_argument('--kernel-bytes', type=float, default=64,
+        help="MB of the largest HDU of each file the kernels are timed on")
+
+ap.add_argument('--workdir', default=None,
+        help="Where the converted files are written; a temporary"
+             " directory by default")
+
+ap.add_argument('--output', default=None,
+        help="JSON file of the results, default standard output")
+
+ap.add_argument('input', nargs='*',
+        help="FITS files, default those listed in testdata/files")
+
+ns = ap.parse_args()
+
+def best(func, *args):
+    """ Fastest time of ns.repeat calls of func, each with an empty
+        chunk cache """
+    times = []
+    for i in range(max(ns.repeat, 1)):
+        fsfits.cache.default.clear()
+        t0 = time.time()
+        func(*args)
+        times.append(time.time() - t0)
+    return min(times)
+
+def du(path):
+    """ Bytes in the files under path """
+    if os.path.isfile(path):
+        return os.path.getsize(path)
+    total = 0
+    for dirpath, dirnames, filenames in os.walk(path):
+        for filename in filenames:
+            total += os.path.getsize(os.path.join(dirpath, filename))
+    return total
+
+def read_fits(filename):
+    """ data of the HDUs with data, and their names """
+    hdus = []
+    fin = fitsio.FITS(filename)
+    for hdui, hdu in enumerate(fin):
+        if hdu.has_data():
+            hdus.append(("HDU-%04d" % hdui, hdu.read()))
+    fin.close()
+    return hdus
+
+def subset(data):
+    """ The subset to read of an HDU: a few columns of a table, a
+        band of rows of an image. """
+    if data.dtype.names:
+        return {'columns' : list(data.dtype.names[:2])}
+    lo = len(data) // 2
+    return {'rows' : (lo, min(lo + 256, len(data))), 'ndim' : data.ndim}
+
+def fits_subset(filename, subsets):
+    fin = fitsio.FITS(filename)
+    for hdui, hdu in enumerate(fin):
+        name = "HDU-%04d" % hdui
+        if name not in subsets:
+            continue
+        sub = subsets[name]
+        if 'columns' in sub:
+            hdu.read(columns=sub['columns'])
+        else:
+            lo, hi = sub['rows']
+            hdu[(slice(lo, hi),) + (slice(None),) * (sub['ndim'] - 1)]
+    fin.close()
+
+def write_fshr(path, hdus):
+    if os.path.exists(path):
+        shutil.rmtree(path)
+    with fsfits.FSHR.create(path) as fout:
+        for name, data in hdus:
+            with fout.create_block(name, data.shape, data.dtype) as block:
+                block[...] = data
+
+def convert_fshr(filename, path):
+    write_fshr(path, read_fits(filename))
+
+def read_fshr(path):
+    with fsfits.FSHR.open(path) as ff:
+        for key in ff:
+            ff[key][...]
+
+def fshr_subset(path, subsets):
+    with fsfits.FSHR.open(path) as ff:
+        for key, sub in subsets.items():
+            block = ff[key]
+            if 'columns' in sub:
+                block[sub['columns']]
+            else:
+                lo, hi = sub['rows']
+                block[lo:hi]
+
+def write_hdf5(path, hdus):
+    with h5py.File(path, 'w') as ff:
+        for name, data in hdus:
+            ff.create_dataset(name, data=data)
+
+def read_hdf5(path):
+    with h5py.File(path, 'r') as ff:
+        for name in ff:
+            ff[name][...]
+
+def hdf5_subset(path, subsets):
+    with h5py.File(path, 'r') as ff:
+        for name, sub in subsets.items():
+            if 'columns' in sub:
+                ff[name][tuple(sub['columns'])]
+            else:
+                lo, hi = sub['rows']
+                ff[name][lo:hi]
+
+def bench_file(filename, workdir):
+    """ Read, write and conversion times and sizes of one file. """
+    hdus = read_fits(filename)
+    nbytes = sum(data.nbytes for name, data in hdus)
+    subsets = dict((name, subset(data)) for name, data in hdus
+            if data.ndim > 0 and len(data) > 0)
+    base = os.path.join(workdir, os.path.basename(filename))
+    fshr = base + '.fshr'
+
+    result = {'file' : filename, 'nbytes' : nbytes, 'nhdu' : len(hdus),
+            'bytes' : {}, 'seconds' : {}}
+    seconds = result['seconds']
+    seconds['fits_read'] = best(read_fits, filename)
+    seconds['fits_subset'] = best(fits_subset, filename, subsets)
+    seconds['fshr_write'] = best(write_fshr, fshr, hdus)
+    seconds['fshr_convert'] = best(convert_fshr, filename, fshr)
+    seconds['fshr_read'] = best(read_fshr, fshr)
+    seconds['fshr_subset'] = best(fshr_subset, fshr, subsets)
+    result['bytes']['fits'] = du(filename)
+    result['bytes']['fshr'] = du(fshr)
+    if h5py is not None:
+        hdf5 = base + '.h5'
+        seconds['hdf5_write'] = best(write_hdf5, hdf5, hdus)
+        seconds['hdf5_read'] = best(read_hdf5, hdf5)
+        seconds['hdf5_subset'] = best(hdf5_subset, hdf5, subsets)
+        result['bytes']['hdf5'] = du(hdf5)
+    # the subsets are too small for a meaningful throughput
+    result['MBps'] = dict((key, nbytes / t / 1e6)
+            for key, t in seconds.items() if 'subset' not in key and t > 0)
+    result['ratio'] = dict((key, float(nbytes) / size)
+            for key, size in result['bytes'].items() if size > 0)
+    return result, hdus
+
+def bench_kernels(filename, hdus, threads, block_sizes):
+    """ Kernel times on the largest HDU of the file. """
+    results = []
+    if len(hdus) == 0:
+        return results
+    name, data = max(hdus, key=lambda hdu: hdu[1].nbytes)
+    data = numpy.ascontiguousarray(data).reshape(-1)
+    data = data[:max(int(ns.kernel_bytes * 1024 * 1024) // data.dtype.itemsize,
+        1)]
+    old = bitshuffle.set_num_threads()
+    try:
+        for nthreads in threads:
+            bitshuffle.set_num_threads(nthreads)
+            for block_size in block_sizes:
+                compressed = bitshuffle.compress_lz4(data, block_size)
+                shuffled = bitshuffle.bitshuffle(data, block_size)
+                seconds = {
+                    'bitshuffle' : best(bitshuffle.bitshuffle,
+                        data, block_size),
+                    'bitunshuffle' : best(bitshuffle.bitunshuffle,
+                        shuffled, block_size),
+                    'compress_lz4' : best(bitshuffle.compress_lz4,
+                        data, block_size),
+                    'decompress_lz4' : best(bitshuffle.decompress_lz4,
+                        compressed, data.shape, data.dtype, block_size),
+                }
+                # the share of LZ4 in the compressed routines
+                seconds['lz4_compress'] = max(seconds['compress_lz4']
+                        - seconds['bitshuffle'], 0)
+                seconds['lz4_decompress'] = max(seconds['decompress_lz4']
+                        - seconds['bitunshuffle'], 0)
+                results.append({'file' : filename, 'hdu' : name,
+                    'dtype' : data.dtype.str, 'nbytes' : data.nbytes,
+                    'threads' : nthreads,
+                    'block_size' : block_size or
+                        bitshuffle.default_block_size(data.dtype.itemsize),
+                    'ratio' : float(data.nbytes) / len(compressed),
+                    'seconds' : seconds,
+                    'MBps' : dict((key, data.nbytes / t / 1e6)
+                        for key, t in seconds.items() if t > 0)})
+    finally:
+        bitshuffle.set_num_threads(old)
+    return results
+
+def inputs():
+    if ns.input:
+        return ns.input
+    filenames = []
+    with file(os.path.join(ns.root, 'files'), 'r') as ff:
+        for line in ff:
+            line = line.strip()
+            if not line:
+                continue
+            filename = os.path.join(ns.root, line)
+            if os.path.exists(filename):
+                filenames.append(filename)
+            else:
+                print >>sys.stderr, "skipping %s, run testdata/sync.sh" % line
+    return filenames
+
+def main():
+    if ns.threads is None:
+        threads = sorted(set([1, multiprocessing.cpu_count()]))
+    else:
+        threads = [int(t) for t in ns.threads.split(',')]
+    block_sizes = [int(b) for b in ns.block_sizes.split(',')]
+
+    workdir = ns.workdir or tempfile.mkdtemp(prefix='fshr-bench-')
+    results = {'host' : {
+            'platform' : platform.platform(),
+            'processor' : platform.processor(),
+            'cpu_count' : multiprocessing.cpu_count(),
+            'isa' : bitshuffle.select_isa(),
+            'bitshuffle' : bitshuffle.__version__,
+            'numpy' : numpy.__version__,
+            'h5py' : h5py.__version__ if h5py is not None else None,
+            'time' : time.strftime('%Y-%m-%dT%H:%M:%S'),
+            },
+            'repeat' : ns.repeat,
+            # how reads repeated in the process meet the chunk cache
+            'cache' : {'cleared' : 'before each run',
+                'nbytes' : fsfits.cache.default.nbytes},
+            'files' : [], 'kernels' : []}
+    try:
+        for filename in inputs():
+            print >>sys.stderr, filename
+            result, hdus = bench_file(filename, workdir)
+            results['files'].append(result)
+            results['kernels'].extend(
+                bench_kernels(filename, hdus, threads, block_sizes))
+    finally:
+        if ns.workdir is None:
+            shutil.rmtree(workdir)
+
+    if ns.output is None:
+        json.dump(results, sys.stdout, indent=1, sort_keys=True)
+        print
+    else:
+        with file(ns.output, 'w') as ff:
+            json.dump(results, ff, indent=1, sort_keys=True)
+
+main()
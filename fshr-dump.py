@@ -2,17 +2,17 @@ import fsfits
 from argparse import ArgumentParser
 ap = ArgumentParser()
 
+ap.add_argument('--prefetch', type=int, default=2,
+        help="Number of HDUs read ahead in the background")
 ap.add_argument('input')
 
 ns = ap.parse_args()
 
 def main():
     with fsfits.FSHR.open(ns.input) as fout:
-        for key in fout:
+        for key, hdu, data in fout.iter_data(prefetch=ns.prefetch):
             print key
-            hdu = fout[key]
             header = hdu.metadata
             print header
-            data = hdu[...]
             print data
 main()
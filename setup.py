@@ -5,7 +5,8 @@ import numpy
 
 def myext(*args):
     return Extension(*args, include_dirs=["./", numpy.get_include()],
-            extra_compile_args=['-std=c99'] )
+            extra_compile_args=['-std=c99', '-fopenmp'],
+            extra_link_args=['-fopenmp'], libraries=['z'] )
 extensions = [
         myext("fsfits.bitshuffle.ext", ["fsfits/bitshuffle/ext.pyx", 
                 "fsfits/bitshuffle/bitshuffle.c", 
@@ -0,0 +1,64 @@
+""" Block.append never changes the bytes a reader of the old chunk
+    index decodes. Run with nose, or as a script. """
+import os.path
+import shutil
+import tempfile
+import numpy
+import fsfits
+
+def check_append(codec, checksums, layout, mmap):
+    path = tempfile.mkdtemp()
+    try:
+        dtype = numpy.dtype([('id', 'i8'), ('flux', 'f4')])
+        old = numpy.zeros(1000, dtype)
+        old['id'] = numpy.arange(1000)
+        old['flux'] = numpy.sin(old['id'])
+        new = numpy.zeros(100, dtype)
+        new['id'] = numpy.arange(1000, 1100)
+        new['flux'] = -1
+        # a partial last chunk, rewritten by the append
+        with fsfits.Block.create(path, old.shape, dtype, layout=layout,
+                codec=codec, block_size=64, checksums=checksums) as block:
+            block[...] = old
+
+        reader = fsfits.Block.open(path, mmap)
+        assert (reader[...] == old).all()
+        files = [stream.datafilename
+                for stream, subshape in reader.streams.values()]
+        before = [open(f, 'rb').read() for f in files]
+
+        fsfits.Block.open(path).append(new)
+
+        for f, content in zip(files, before):
+            assert open(f, 'rb').read()[:len(content)] == content
+        # decoded again from the files, with the old index
+        fsfits.cache.default.clear()
+        assert reader.shape == old.shape
+        assert (reader[...] == old).all()
+        assert (reader[990:1000] == old[990:]).all()
+
+        fsfits.cache.default.clear()
+        block = fsfits.Block.open(path, mmap)
+        assert block.shape == (1100,)
+        assert (block[...] == numpy.concatenate([old, new])).all()
+        assert (block[950:1050] == numpy.concatenate([old, new])[950:1050]
+                ).all()
+
+        # and once more, the last chunk kept is a long one now
+        fsfits.Block.open(path).append(new[:10])
+        fsfits.cache.default.clear()
+        block = fsfits.Block.open(path, mmap)
+        assert (block[...] == numpy.concatenate([old, new, new[:10]])).all()
+    finally:
+        shutil.rmtree(path)
+
+def test_append():
+    for codec in fsfits.CODECS:
+        for checksums in (False, True):
+            for layout in ('flat', 'columns'):
+                for mmap in (True, False):
+                    yield check_append, codec, checksums, layout, mmap
+
+if __name__ == '__main__':
+    for test in test_append():
+        test[0](*test[1:])